@@ -5,6 +5,7 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
@@ -18,6 +19,7 @@
 #define MAXARGS 128    /* max args on a command line */
 #define MAXJOBS 16     /* max jobs at any point in time */
 #define MAXJID 1 << 16 /* max job ID */
+#define SIOBUF 1024    /* max sio_printf message */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -89,6 +91,7 @@ typedef void handler_t(int);
 handler_t *Signal(int signum, handler_t *handler);
 size_t sio_strlen(char s[]);
 ssize_t sio_puts(char s[]);
+ssize_t sio_printf(const char *fmt, ...);
 /*
  * main - The shell's main routine 
  */
@@ -200,16 +203,18 @@ void eval(char *cmdline)
         int state = bg ? BG : FG;
         addjob(jobs, pid, state, cmdline);
         int jid = pid2jid(pid);
+        if (bg)
+        {
+            /* Out before sigchld_handler can write about the job */
+            printf("[%d] (%d) %s", jid, pid, cmdline);
+            fflush(stdout);
+        }
         sigprocmask(SIG_SETMASK, &prev_mask, NULL);
 
         if (!bg)
         {
             waitfg(pid);
         }
-        else
-        {
-            printf("[%d] (%d) %s", jid, pid, cmdline);
-        }
     }
 }
 
@@ -394,7 +399,7 @@ void waitfg(pid_t pid)
 void sigchld_handler(int sig)
 {
     int olderrno = errno;
-    int status, pid;
+    int status, pid, jid;
     sigset_t mask, prev_mask;
     sigfillset(&mask);
 
@@ -404,6 +409,7 @@ void sigchld_handler(int sig)
     {
         if (pid == fg_pid)
             fg_pid = 0;
+        jid = pid2jid(pid); /* before deletejob forgets it */
         //struct job_t *job = getjobpid(jobs, pid);
         //if (job->state!=ST) deletejob(jobs, pid);
         if (WIFEXITED(status) || WIFSIGNALED(status))
@@ -411,13 +417,13 @@ void sigchld_handler(int sig)
         if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
         {
             //struct job_t *job = getjobpid(jobs, pid);
-            printf("Job [%d] (%d) terminated by signal %d\n", pid2jid(pid), pid, SIGINT);
+            sio_printf("Job [%d] (%d) terminated by signal %d\n", jid, pid, SIGINT);
         }
         if (WIFSTOPPED(status) && (WSTOPSIG(status) == SIGTSTP || WSTOPSIG(status) == SIGSTOP))
         {
             struct job_t *job = getjobpid(jobs, pid);
             job->state = ST;
-            printf("Job [%d] (%d) stopped by signal %d\n", pid2jid(pid), pid, SIGTSTP);
+            sio_printf("Job [%d] (%d) stopped by signal %d\n", jid, pid, SIGTSTP);
         }
     }
     sigprocmask(SIG_SETMASK, &prev_mask, NULL);
@@ -739,3 +745,79 @@ ssize_t sio_puts(char s[]) /* Put string */
 {
     return write(STDOUT_FILENO, s, sio_strlen(s)); //line:csapp:siostrlen
 }
+
+/* sio_utoa - Write v in base b at s, return the number of digits */
+static size_t sio_utoa(unsigned long v, char s[], int b)
+{
+    char digits[64];
+    size_t i = 0, n = 0;
+
+    do
+    {
+        digits[i++] = "0123456789abcdef"[v % b];
+    } while ((v /= b) > 0);
+    while (i > 0)
+        s[n++] = digits[--i];
+    return n;
+}
+
+/*
+ * sio_printf - printf for signal handlers: %d %ld %s %x %lx %p and %%,
+ *     formatted on the stack and written with a single write(). Longer
+ *     messages than SIOBUF are cut short.
+ */
+ssize_t sio_printf(const char *fmt, ...)
+{
+    char buf[SIOBUF], num[64], *s;
+    size_t n = 0, len;
+    int lng;
+    long v;
+    va_list ap;
+
+    va_start(ap, fmt);
+    for (; *fmt && n < sizeof(buf); fmt++)
+    {
+        if (*fmt != '%' || fmt[1] == '\0')
+        {
+            buf[n++] = *fmt;
+            continue;
+        }
+        s = num;
+        lng = fmt[1] == 'l' && fmt[2] != '\0';
+        fmt += 1 + lng;
+        switch (*fmt)
+        {
+        case 'd':
+            v = lng ? va_arg(ap, long) : va_arg(ap, int);
+            len = 0;
+            if (v < 0)
+                num[len++] = '-';
+            len += sio_utoa(v < 0 ? -(unsigned long)v : v, num + len, 10);
+            break;
+        case 'x':
+            len = sio_utoa(lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned), num, 16);
+            break;
+        case 'p':
+            num[0] = '0';
+            num[1] = 'x';
+            len = 2 + sio_utoa((unsigned long)va_arg(ap, void *), num + 2, 16);
+            break;
+        case 's':
+            if ((s = va_arg(ap, char *)) == NULL)
+                s = "(null)";
+            len = sio_strlen(s);
+            break;
+        case '%':
+            s = (char *)fmt;
+            len = 1;
+            break;
+        default: /* Not a conversion we know, copy it as is */
+            s = (char *)fmt - lng - 1;
+            len = lng + 2;
+        }
+        while (len-- > 0 && n < sizeof(buf))
+            buf[n++] = *s++;
+    }
+    va_end(ap);
+    return write(STDOUT_FILENO, buf, n);
+}
@@ -0,0 +1,88 @@
+/* cpu_set_t and pthread_setaffinity_np are GNU extensions, and csapp.h
+ * does not build with _GNU_SOURCE, so this file keeps cpu sets to itself. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sched.h>
+#include <pthread.h>
+#include "affinity.h"
+
+#define NODE_CPULIST "/sys/devices/system/node/node%d/cpulist"
+/* highest node id probed in sysfs, ids may be sparse */
+#define MAX_NODE_ID 1024
+
+static cpu_set_t node_sets[MAX_NODES];
+static int num_nodes = 0;
+
+/* Parse a sysfs cpu list such as "0-3,8-11\n" into set. */
+static void parse_cpulist(char *s, cpu_set_t *set){
+    char *end;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while(isdigit(*s)){
+        lo = hi = strtol(s, &end, 10);
+        if(*end == '-') hi = strtol(end + 1, &end, 10);
+        for(; lo <= hi && lo < CPU_SETSIZE; lo++) CPU_SET(lo, set);
+        s = (*end == ',') ? end + 1 : end;
+    }
+}
+
+/* Find the cpus of each NUMA node we are allowed to run on, return the
+ * number of nodes or -1. Without NUMA information in sysfs the whole
+ * machine is a single node. */
+int numa_init(void){
+    char path[64], buf[4096];
+    cpu_set_t allowed, *sets = node_sets;  // filled densely, node ids may be sparse
+    FILE *fp;
+    int n = 0;
+
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) < 0) return -1;
+    for(int node = 0; node < MAX_NODE_ID && n < MAX_NODES; node++){
+        sprintf(path, NODE_CPULIST, node);
+        if((fp = fopen(path, "r")) == NULL) continue;
+        if(fgets(buf, sizeof(buf), fp) != NULL){
+            parse_cpulist(buf, &sets[n]);
+            CPU_AND(&sets[n], &sets[n], &allowed);
+            // memory-only nodes and nodes outside our cpuset are no use.
+            if(CPU_COUNT(&sets[n]) > 0) n++;
+        }
+        fclose(fp);
+    }
+    if(n == 0){
+        sets[0] = allowed;
+        n = 1;
+    }
+    return num_nodes = n;
+}
+
+/* The i-th cpu of a node, wrapping around, or -1 if there is none. */
+int node_cpu(int node, int i){
+    cpu_set_t *set;
+    int count;
+
+    if(node < 0 || node >= num_nodes) return -1;
+    set = &node_sets[node];
+    if((count = CPU_COUNT(set)) == 0) return -1;
+    i %= count;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, set) && i-- == 0) return cpu;
+    }
+    return -1;
+}
+
+/* Restrict the calling thread to the cpus of a node, threads it creates
+ * inherit it. */
+int pin_node(int node){
+    if(node < 0 || node >= num_nodes) return -1;
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_sets[node]);
+}
+
+int pin_cpu(int cpu){
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
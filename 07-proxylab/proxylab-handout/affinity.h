@@ -0,0 +1,12 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#define MAX_NODES 64
+
+/* NUMA nodes are numbered 0..numa_init()-1, their cpu sets live in affinity.c */
+int numa_init(void);
+int node_cpu(int node, int i);
+int pin_node(int node);
+int pin_cpu(int cpu);
+
+#endif
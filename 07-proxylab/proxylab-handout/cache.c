@@ -1,24 +1,71 @@
+#include <stdint.h>
 #include "cache.h"
 
+/*
+ * Snapshot file layout (native byte order), records most recently used first:
+ *   snap_hdr_t | count * { snap_rec_t, finger + '\0', object }
+ * Fingers and objects are each padded to 8 bytes so objects can be served
+ * straight out of the mapping.
+ */
+#define SNAP_MAGIC "PXYSNAP1"
+#define SNAP_ALIGN(n) (((size_t)(n) + 7) & ~(size_t)7)
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t pad;
+} snap_hdr_t;
+
+typedef struct {
+    uint32_t finger_len;
+    uint32_t obj_size;
+} snap_rec_t;
+
+static int lookup(cache_t *cp, char *finger, char *dest, size_t *lengthp, int variant, unsigned long *genp);
+
 void cache_init(cache_t *cp, int n){
     cp->fingers = (char **)Malloc(n*sizeof(char*));
     cp->objects = (char **)Malloc(n*sizeof(char*));
+    cp->buffers = (char **)Malloc(n*sizeof(char*));
     cp->timestamps = (unsigned long *)Calloc(n, sizeof(unsigned long));
+    cp->expires = (time_t *)Calloc(n, sizeof(time_t));
     cp->valids = (int *)Calloc(n, sizeof(int));
     cp->obj_sizes = (size_t *)Calloc(n, sizeof(size_t));
+    cp->variants = (char **)Calloc(n, sizeof(char*));
+    cp->var_sizes = (size_t *)Calloc(n, sizeof(size_t));
+    cp->gens = (unsigned long *)Calloc(n, sizeof(unsigned long));
+    cp->next_gen = 1;
     for(int i = 0; i < n; i++){
         cp->fingers[i] = (char *)Malloc(MAXLINE);
-        cp->objects[i] = (char *)Malloc(MAX_OBJECT_SIZE);
+        cp->buffers[i] = (char *)Malloc(MAX_OBJECT_SIZE);
+        cp->objects[i] = cp->buffers[i];
     }
     cp->global_time = 1;
     cp->num_obj = n;
     cp->read_count = 0;
-    Sem_init(&cp->mutex, 0, 1);
-    Sem_init(&cp->writable, 0, 1);
-    Sem_init(&cp->readable, 0, 1);
+    cp->snap_base = NULL;
+    cp->snap_size = 0;
+    csem_init(&cp->mutex, 1);
+    csem_init(&cp->writable, 1);
+    csem_init(&cp->readable, 1);
 }
 
 int get_obj(cache_t *cp, char *finger, char *dest, size_t *lengthp){
+    return lookup(cp, finger, dest, lengthp, 0, NULL);
+}
+
+/* get_obj that also returns the generation of the object, for store_variant. */
+int get_obj_gen(cache_t *cp, char *finger, char *dest, size_t *lengthp, unsigned long *genp){
+    return lookup(cp, finger, dest, lengthp, 0, genp);
+}
+
+/* Copy the gzip variant stored with the object of finger, -1 if there is none. */
+int get_variant(cache_t *cp, char *finger, char *dest, size_t *lengthp){
+    return lookup(cp, finger, dest, lengthp, 1, NULL);
+}
+
+/* Find finger and copy its object, or its variant if variant is set. */
+static int lookup(cache_t *cp, char *finger, char *dest, size_t *lengthp, int variant, unsigned long *genp){
     // printf("Searching: %s\n", finger);
     // printf("Showing cache:\n");
     // for(int i = 0; i<cp->num_obj; i++){
@@ -35,11 +82,15 @@ int get_obj(cache_t *cp, char *finger, char *dest, size_t *lengthp){
     V(&cp->readable);   
 
     int index = -1;
+    time_t now = time(NULL);
     for(int i =0; i < cp->num_obj; i++){
-        if((cp->valids[i]) && (strcmp(cp->fingers[i], finger) == 0)){
+        if((cp->valids[i]) && (!cp->expires[i] || cp->expires[i] > now) &&
+           (strcmp(cp->fingers[i], finger) == 0)){
+            if(variant && cp->variants[i] == NULL) break;
             index = i;
-            *lengthp = cp->obj_sizes[i];
-            memcpy(dest, cp->objects[i], *lengthp);
+            if(genp) *genp = cp->gens[i];
+            *lengthp = variant ? cp->var_sizes[i] : cp->obj_sizes[i];
+            memcpy(dest, variant ? cp->variants[i] : cp->objects[i], *lengthp);
             break;
         }
     }
@@ -59,7 +110,19 @@ int get_obj(cache_t *cp, char *finger, char *dest, size_t *lengthp){
     return index;
 }
 
+/* Forget the variant of block i, called with the cache write-locked. */
+static void drop_variant(cache_t *cp, int i){
+    if(cp->variants[i]) Free(cp->variants[i]);
+    cp->variants[i] = NULL;
+    cp->var_sizes[i] = 0;
+}
+
 void store_obj(cache_t *cp, char *finger, char* content, size_t length){
+    store_obj_ttl(cp, finger, content, length, 0);
+}
+
+/* Store an object that get_obj stops returning after ttl seconds (never if ttl <= 0). */
+void store_obj_ttl(cache_t *cp, char *finger, char* content, size_t length, int ttl){
 
     // printf("Showing cache:\n");
     // for(int i = 0; i<cp->num_obj; i++){
@@ -73,25 +136,34 @@ void store_obj(cache_t *cp, char *finger, char* content, size_t length){
     P(&cp->readable);
     P(&cp->writable);
     //printf("1\n");
-    // find least recently used block.
-    int index = 0, time_stamp = cp->global_time;
-    for(int i =0; i<cp->num_obj; i++){
-        if(cp->valids[i]){
-            if(cp->timestamps[i] <= time_stamp){
-                time_stamp = cp->timestamps[i];
-                index = i;
-            }
-        }
-        else{
+    // replace an older copy of the object, else the least recently used
+    // block, expired blocks count as free.
+    int index = -1, time_stamp = cp->global_time;
+    time_t now = time(NULL);
+    for(int i = 0; i < cp->num_obj; i++){
+        if(cp->valids[i] && !strcmp(cp->fingers[i], finger)){
             index = i;
             break;
         }
     }
-    // store object at index
+    for(int i = 0; i < cp->num_obj && index < 0; i++){
+        if(!cp->valids[i] || (cp->expires[i] && cp->expires[i] <= now)) index = i;
+    }
+    for(int i = 0; i < cp->num_obj && index < 0; i++){
+        if(cp->timestamps[i] <= time_stamp) time_stamp = cp->timestamps[i];
+    }
+    for(int i = 0; i < cp->num_obj && index < 0; i++){
+        if(cp->timestamps[i] == time_stamp) index = i;
+    }
+    // store object at index, the variant of what was there goes with it.
     strcpy(cp->fingers[index], finger);
+    cp->objects[index] = cp->buffers[index];
     memcpy(cp->objects[index], content, length);
     cp->valids[index] = 1;
     cp->obj_sizes[index] = length;
+    cp->expires[index] = ttl > 0 ? now + ttl : 0;
+    drop_variant(cp, index);
+    cp->gens[index] = cp->next_gen++;
 
     //P(&cp->mutex);
     cp->timestamps[index] = (cp->global_time)++;
@@ -109,14 +181,166 @@ void store_obj(cache_t *cp, char *finger, char* content, size_t length){
     //printf("4\n");
 }
 
+/* Attach a gzip variant to the object of finger, as long as it is still
+ * generation gen, the one the variant was made from. */
+void store_variant(cache_t *cp, char *finger, unsigned long gen, char *content, size_t length){
+    time_t now = time(NULL);
+
+    P(&cp->readable);
+    P(&cp->writable);
+    for(int i = 0; i < cp->num_obj; i++){
+        if(cp->valids[i] && (!cp->expires[i] || cp->expires[i] > now) &&
+           cp->gens[i] == gen && !strcmp(cp->fingers[i], finger)){
+            drop_variant(cp, i);
+            cp->variants[i] = (char *)Malloc(length);
+            memcpy(cp->variants[i], content, length);
+            cp->var_sizes[i] = length;
+            break;
+        }
+    }
+    V(&cp->writable);
+    V(&cp->readable);
+}
+
 void cache_destory(cache_t *cp){
     for(int i = 0; i < cp->num_obj; i++){
         Free(cp->fingers[i]);
-        Free(cp->objects[i]);
+        Free(cp->buffers[i]);
+        if(cp->variants[i]) Free(cp->variants[i]);
     }
     Free(cp->fingers);
     Free(cp->objects);
+    Free(cp->buffers);
     Free(cp->timestamps);
+    Free(cp->expires);
     Free(cp->valids);
     Free(cp->obj_sizes);
+    Free(cp->variants);
+    Free(cp->var_sizes);
+    Free(cp->gens);
+    if(cp->snap_base) munmap(cp->snap_base, cp->snap_size);
+}
+
+/* Write all valid objects to path, return the number of objects written or -1.
+ * The file is written aside and renamed, so a live mapping of an older
+ * snapshot stays intact. */
+int cache_dump(cache_t *cp, char *path){
+    char tmp[MAXLINE], pad[8] = {0};
+    int fd, n = 0, rc = -1, *order;
+    snap_hdr_t hdr;
+    snap_rec_t rec;
+
+    snprintf(tmp, MAXLINE, "%s.tmp", path);
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, DEF_MODE)) < 0) return -1;
+    order = (int *)Malloc(cp->num_obj * sizeof(int));
+
+    P(&cp->readable);
+    P(&cp->mutex);
+    if((++cp->read_count) == 1) P(&cp->writable);
+    V(&cp->mutex);
+    V(&cp->readable);
+
+    // sort valid blocks by timestamp, most recently used first.
+    // Objects with a ttl are short-lived and not worth a warm start.
+    for(int i = 0; i < cp->num_obj; i++){
+        if(!cp->valids[i] || cp->expires[i]) continue;
+        int j = n++;
+        for(; j > 0 && cp->timestamps[order[j-1]] < cp->timestamps[i]; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+    }
+
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.count = n;
+    hdr.pad = 0;
+    if(rio_writen(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto out;
+    for(int k = 0; k < n; k++){
+        int i = order[k];
+        rec.finger_len = strlen(cp->fingers[i]) + 1;
+        rec.obj_size = cp->obj_sizes[i];
+        if(rio_writen(fd, &rec, sizeof(rec)) != sizeof(rec) ||
+           rio_writen(fd, cp->fingers[i], rec.finger_len) != rec.finger_len ||
+           rio_writen(fd, pad, SNAP_ALIGN(rec.finger_len) - rec.finger_len) < 0 ||
+           rio_writen(fd, cp->objects[i], rec.obj_size) != rec.obj_size ||
+           rio_writen(fd, pad, SNAP_ALIGN(rec.obj_size) - rec.obj_size) < 0)
+            goto out;
+    }
+    rc = n;
+
+out:
+    P(&cp->mutex);
+    if((--(cp->read_count)) == 0) V(&cp->writable);
+    V(&cp->mutex);
+
+    Free(order);
+    if(close(fd) < 0) rc = -1;
+    if(rc < 0 || rename(tmp, path) < 0){
+        unlink(tmp);
+        return -1;
+    }
+    return rc;
+}
+
+/* Warm the cache from a snapshot written by cache_dump. The file is mapped
+ * rather than read: only fingers are copied, objects are served from the
+ * mapping and paged in on their first hit. Return the number of objects
+ * loaded or -1. Meant to be called once, before the cache is shared. */
+int cache_load(cache_t *cp, char *path){
+    int fd, n;
+    struct stat st;
+    char *base, *p, *end;
+    snap_hdr_t *hdr;
+    snap_rec_t *rec;
+
+    if(cp->snap_base) return -1;
+    if((fd = open(path, O_RDONLY, 0)) < 0) return -1;
+    if(fstat(fd, &st) < 0 || st.st_size < sizeof(snap_hdr_t)){
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) return -1;
+
+    hdr = (snap_hdr_t *)base;
+    if(memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic))){
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    P(&cp->readable);
+    P(&cp->writable);
+    p = base + sizeof(snap_hdr_t);
+    end = base + st.st_size;
+    for(n = 0; n < hdr->count && n < cp->num_obj; n++){
+        if(end - p < sizeof(snap_rec_t)) break;
+        rec = (snap_rec_t *)p;
+        p += sizeof(snap_rec_t);
+        if(rec->finger_len == 0 || rec->finger_len > MAXLINE ||
+           rec->obj_size > MAX_OBJECT_SIZE ||
+           end - p < SNAP_ALIGN(rec->finger_len) + SNAP_ALIGN(rec->obj_size) ||
+           p[rec->finger_len - 1] != '\0')
+            break;
+        strcpy(cp->fingers[n], p);
+        p += SNAP_ALIGN(rec->finger_len);
+        cp->objects[n] = p;
+        cp->obj_sizes[n] = rec->obj_size;
+        cp->valids[n] = 1;
+        cp->expires[n] = 0;
+        cp->gens[n] = cp->next_gen++;
+        p += SNAP_ALIGN(rec->obj_size);
+    }
+    // keep the snapshot's LRU order.
+    for(int i = 0; i < n; i++)
+        cp->timestamps[i] = cp->global_time + n - 1 - i;
+    cp->global_time += n;
+    V(&cp->writable);
+    V(&cp->readable);
+
+    if(n == 0) munmap(base, st.st_size);
+    else{
+        cp->snap_base = base;
+        cp->snap_size = st.st_size;
+    }
+    return n;
 }
@@ -10,13 +10,21 @@
 typedef struct {
     char **fingers;
     unsigned long *timestamps;
+    time_t *expires;    /* 0 if the object never expires */
     int *valids;
-    char **objects;
+    char **objects;     /* points into buffers[i] or into the snapshot map */
+    char **buffers;
     size_t *obj_sizes;
+    char **variants;    /* gzip variant of objects[i], NULL if none */
+    size_t *var_sizes;
+    unsigned long *gens; /* bumped whenever slot i gets a new object */
+    unsigned long next_gen;
     int num_obj;
     int global_time;
     int read_count;
-    sem_t mutex, readable, writable;
+    csem_t mutex, readable, writable;
+    void *snap_base;    /* mmap'ed snapshot, NULL if none was loaded */
+    size_t snap_size;
 } cache_t;
 
 void cache_init(cache_t *cp, int n);
@@ -25,6 +33,18 @@ void cache_destory(cache_t *cp);
 
 int get_obj(cache_t *cp, char *finger, char *dest, size_t *lengthp);
 
+int get_obj_gen(cache_t *cp, char *finger, char *dest, size_t *lengthp, unsigned long *genp);
+
+int get_variant(cache_t *cp, char *finger, char *dest, size_t *lengthp);
+
+void store_variant(cache_t *cp, char *finger, unsigned long gen, char *content, size_t length);
+
 void store_obj(cache_t *cp, char *finger, char *content, size_t lenght);
 
+void store_obj_ttl(cache_t *cp, char *finger, char *content, size_t length, int ttl);
+
+int cache_dump(cache_t *cp, char *path);
+
+int cache_load(cache_t *cp, char *path);
+
 #endif
\ No newline at end of file
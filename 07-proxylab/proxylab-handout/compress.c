@@ -0,0 +1,155 @@
+#include <zlib.h>
+#include "compress.h"
+
+void zbuf_init(zbuf_t *zp, int n){
+    zp->buf = Calloc(n, sizeof(zjob_t));
+    zp->n = n;
+    zp->front = zp->rear = zp->count = 0;
+    csem_init(&zp->mutex, 1);
+    csem_init(&zp->items, 0);
+}
+
+void zbuf_destory(zbuf_t *zp){
+    Free(zp->buf);
+}
+
+/* Queue an object for compression. Never blocks the request path:
+ * return -1 and drop the job if the queue is full. */
+int zbuf_add(zbuf_t *zp, cache_t *cp, char *finger){
+    P(&zp->mutex);
+    if(zp->count == zp->n){
+        V(&zp->mutex);
+        return -1;
+    }
+    zp->buf[zp->rear].cp = cp;
+    strcpy(zp->buf[zp->rear].finger, finger);
+    zp->rear = (zp->rear + 1) % zp->n;
+    zp->count++;
+    V(&zp->mutex);
+    V(&zp->items);
+    return 0;
+}
+
+static void zbuf_remove(zbuf_t *zp, zjob_t *job){
+    P(&zp->items);
+    P(&zp->mutex);
+    *job = zp->buf[zp->front];
+    zp->front = (zp->front + 1) % zp->n;
+    zp->count--;
+    V(&zp->mutex);
+}
+
+/* Offset of the body in a response, -1 if the header block is incomplete. */
+long response_body(char *content, size_t length){
+    for(size_t i = 3; i < length; i++){
+        if(content[i] == '\n' && content[i-1] == '\r' &&
+           content[i-2] == '\n' && content[i-3] == '\r')
+            return i + 1;
+    }
+    return -1;
+}
+
+static int is_header(char *line, char *name){
+    size_t n = strlen(name);
+    return !strncasecmp(line, name, n) && line[n] == ':';
+}
+
+/* Value of header name within the first hdr_len bytes, NULL if absent. */
+char *response_header(char *content, long hdr_len, char *name, size_t *vlen){
+    char *p = content, *end = content + hdr_len, *q;
+
+    while(p < end && (q = memchr(p, '\n', end - p)) != NULL){
+        if(is_header(p, name)){
+            for(p += strlen(name) + 1; p < q && (*p == ' ' || *p == '\t'); p++);
+            *vlen = (q > p && q[-1] == '\r') ? q - 1 - p : q - p;
+            return p;
+        }
+        p = q + 1;
+    }
+    return NULL;
+}
+
+static int has_prefix(char *value, size_t vlen, char *prefix){
+    size_t n = strlen(prefix);
+    return vlen >= n && !strncasecmp(value, prefix, n);
+}
+
+/* Whether a cached response is a complete 200 with an uncompressed text body. */
+int compressible(char *content, size_t length){
+    long body = response_body(content, length);
+    char *type;
+    size_t vlen;
+
+    if(body < 0 || length - body < MIN_COMPRESS_SIZE) return 0;
+    if(strncmp(content, "HTTP/1.", 7) || strncmp(content + 8, " 200", 4)) return 0;
+    if(response_header(content, body, "Content-Encoding", &vlen)) return 0;
+    if((type = response_header(content, body, "Content-Type", &vlen)) == NULL) return 0;
+    return has_prefix(type, vlen, "text/") ||
+           has_prefix(type, vlen, "application/javascript") ||
+           has_prefix(type, vlen, "application/json") ||
+           has_prefix(type, vlen, "application/xml");
+}
+
+/* Gzip len bytes of src into dest, return the compressed size or -1. */
+static long gzip_buf(char *src, size_t len, char *dest, size_t size){
+    z_stream zs;
+    long n;
+
+    memset(&zs, 0, sizeof(zs));
+    // windowBits + 16 asks zlib for a gzip wrapper instead of a zlib one.
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)dest;
+    zs.avail_out = size;
+    n = (deflate(&zs, Z_FINISH) == Z_STREAM_END) ? (long)zs.total_out : -1;
+    deflateEnd(&zs);
+    return n;
+}
+
+/* Copy the headers of content into dest, rewritten for a gzip body of zlen
+ * bytes. Return the header length or -1 if it does not fit. */
+static long gzip_headers(char *content, long body, char *dest, long zlen){
+    char *p = content, *end = content + body - 2, *q;  // without the blank line
+    long n = 0;
+
+    while(p < end && (q = memchr(p, '\n', end - p)) != NULL){
+        q++;
+        if(!is_header(p, "Content-Length") && !is_header(p, "Vary")){
+            memcpy(dest + n, p, q - p);
+            n += q - p;
+        }
+        p = q;
+    }
+    if(n + MAXLINE > MAX_OBJECT_SIZE) return -1;
+    n += sprintf(dest + n, "Content-Encoding: gzip\r\nContent-Length: %ld\r\n"
+                 "Vary: Accept-Encoding\r\n\r\n", zlen);
+    return n;
+}
+
+/* Build gzip variants of queued objects and attach them to the identity ones. */
+void *compress_thread(void *vargp){
+    zbuf_t *zp = (zbuf_t *)vargp;
+    zjob_t job;
+    char *obj = Malloc(MAX_OBJECT_SIZE), *zbody = Malloc(MAX_OBJECT_SIZE);
+    char *variant = Malloc(MAX_OBJECT_SIZE);
+    size_t length;
+    unsigned long gen;
+    long body, zlen, hlen;
+
+    pthread_detach(pthread_self());
+    while(1){
+        zbuf_remove(zp, &job);
+        // the object may have been evicted in the meantime.
+        if(get_obj_gen(job.cp, job.finger, obj, &length, &gen) < 0) continue;
+        if((body = response_body(obj, length)) < 0) continue;
+        zlen = gzip_buf(obj + body, length - body, zbody, MAX_OBJECT_SIZE);
+        if(zlen < 0 || zlen >= length - body) continue;
+        if((hlen = gzip_headers(obj, body, variant, zlen)) < 0 ||
+           hlen + zlen > MAX_OBJECT_SIZE)
+            continue;
+        memcpy(variant + hlen, zbody, zlen);
+        store_variant(job.cp, job.finger, gen, variant, hlen + zlen);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* Objects shorter than this are not worth a gzip variant */
+#define MIN_COMPRESS_SIZE 256
+
+typedef struct {
+    cache_t *cp;
+    char finger[MAXLINE];
+} zjob_t;
+
+/* Bounded queue of cached objects waiting for their gzip variant */
+typedef struct {
+    zjob_t *buf;
+    int n;
+    int front;
+    int rear;
+    int count;
+    csem_t mutex;
+    csem_t items;
+} zbuf_t;
+
+void zbuf_init(zbuf_t *zp, int n);
+void zbuf_destory(zbuf_t *zp);
+int zbuf_add(zbuf_t *zp, cache_t *cp, char *finger);
+
+void *compress_thread(void *vargp);
+
+int compressible(char *content, size_t length);
+
+/* Response parsing helpers */
+long response_body(char *content, size_t length);
+char *response_header(char *content, long hdr_len, char *name, size_t *vlen);
+
+#endif
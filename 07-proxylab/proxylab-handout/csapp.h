@@ -7,6 +7,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
@@ -20,6 +22,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -27,6 +31,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -42,15 +47,47 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 8192             /* Default, pooled buffer size */
+#define RIO_MAXBUFSIZE (64 * 1024)   /* Largest a buffer grows for a line */
+#define RIO_POOLMAX 1024             /* Idle buffers kept in the shared pool */
+#define RIO_TPOOLMAX 8               /* and in each thread's own */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer, NULL while released */
+    size_t rio_size;           /* Its size */
+    size_t rio_wcnt;           /* Bytes of a rio_trywritev() already sent */
 } rio_t;
 /* $end rio_t */
 
+/* Semaphore that P and V take without a system call when it is free,
+   a futex wait/wake only happens once a thread has to sleep */
+typedef struct {
+    int count;   /* Units available, the futex word */
+    int waiters; /* Threads in csem_wait's sleep loop */
+    int spin;    /* Tries before csem_wait sleeps */
+} csem_t;
+
+/* Persistent state for buffered Rio writes */
+typedef struct {
+    int rio_fd;                /* Descriptor for this internal buf */
+    size_t rio_cnt;            /* Bytes waiting in internal buf */
+    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+} rio_wbuf_t;
+
+/* Socket options for open_clientfd_opts and open_listenfd_opts, 0 leaves
+   the kernel's default. The last four only apply to listeners. */
+typedef struct {
+    int nodelay;      /* TCP_NODELAY: small writes go out at once */
+    int rcvbuf;       /* SO_RCVBUF in bytes */
+    int sndbuf;       /* SO_SNDBUF in bytes */
+    int fastopen;     /* TCP_FASTOPEN: data in the SYN, a listener's queue length */
+    int defer_accept; /* TCP_DEFER_ACCEPT: seconds to wait for the first data */
+    int backlog;      /* Second argument to listen(), LISTENQ if 0 */
+    int reuseport;    /* SO_REUSEPORT: listeners share the port */
+} sockopts_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -59,8 +96,29 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#define SIO_BUFSIZE 1024       /* Longest sio_printf message */
+#define CONNECT_DELAY 250      /* ms between staggered connects (RFC 8305) */
+#define CONNECT_MAXADDRS 16    /* Addresses open_clientfd tries at most */
+#define CSEM_SPIN 100          /* Tries before a csem_wait goes to sleep */
+
+/* Branch hints for error checks on hot paths */
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* Errors the inline wrappers below ran into. They are counted rather
+   than printed, so a failing hot path costs no stdio. errcount holds
+   this thread's, errcount_total() sums all threads'. */
+typedef struct {
+    unsigned long sem;  /* P and V on a sem_t */
+    unsigned long mem;  /* Malloc, Calloc and Realloc */
+    int last_errno;     /* errno of the latest error */
+    char *last_msg;     /* and the wrapper it came from */
+} errcount_t;
+extern __thread errcount_t errcount;
+void errcount_total(errcount_t *total);
 
 /* Our own error-handling functions */
+void count_error(unsigned long *counter, char *msg) __attribute__((cold, noinline));
 void unix_error(char *msg);
 void posix_error(int code, char *msg);
 void dns_error(char *msg);
@@ -93,11 +151,13 @@ int Sigsuspend(const sigset_t *set);
 /* Sio (Signal-safe I/O) routines */
 ssize_t sio_puts(char s[]);
 ssize_t sio_putl(long v);
+ssize_t sio_printf(const char *fmt, ...);
 void sio_error(char s[]);
 
 /* Sio wrappers */
 ssize_t Sio_puts(char s[]);
 ssize_t Sio_putl(long v);
+ssize_t Sio_printf(const char *fmt, ...);
 void Sio_error(char s[]);
 
 /* Unix I/O wrappers */
@@ -130,12 +190,6 @@ void Fputs(const char *ptr, FILE *stream);
 size_t Fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 void Fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
 
-/* Dynamic storage allocation wrappers */
-void *Malloc(size_t size);
-void *Realloc(void *ptr, size_t size);
-void *Calloc(size_t nmemb, size_t size);
-void Free(void *ptr);
-
 /* Sockets interface wrappers */
 int Socket(int domain, int type, int protocol);
 void Setsockopt(int s, int level, int optname, const void *optval, int optlen);
@@ -169,31 +223,126 @@ void Pthread_once(pthread_once_t *once_control, void (*init_function)());
 
 /* POSIX semaphore wrappers */
 void Sem_init(sem_t *sem, int pshared, unsigned int value);
-void P(sem_t *sem);
-void V(sem_t *sem);
+
+/* csapp semaphores */
+void csem_init(csem_t *sem, unsigned int value);
+void csem_wait_slow(csem_t *sem) __attribute__((noinline));
+void csem_wake(csem_t *sem) __attribute__((noinline));
 
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitb_size(rio_t *rp, int fd, size_t size);
+void rio_release(rio_t *rp);
+void rio_freeb(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_peekline(rio_t *rp, char **linep);
+ssize_t rio_peekn(rio_t *rp, char **p, size_t n);
+void rio_consume(rio_t *rp, size_t n);
+ssize_t rio_tryreadb(rio_t *rp);
+ssize_t rio_trywritev(rio_t *rp, struct iovec *iov, int iovcnt);
+void rio_writeinitb(rio_wbuf_t *wp, int fd);
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+ssize_t rio_flushb(rio_wbuf_t *wp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writevn(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_peekline(rio_t *rp, char **linep);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_clientfd_opts(char *hostname, char *port, sockopts_t *opts);
+int open_listenfd_opts(char *port, sockopts_t *opts);
+int sockopts_parse(sockopts_t *opts, char *spec);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_clientfd_opts(char *hostname, char *port, sockopts_t *opts);
+int Open_listenfd_opts(char *port, sockopts_t *opts);
+
+/*
+ * Inline wrappers for the calls on every request path. The check
+ * compiles to a not-taken branch, the error handling stays out of
+ * line in count_error.
+ */
+/* Dynamic storage allocation wrappers */
+static inline void *Malloc(size_t size)
+{
+    void *p;
+
+    if (unlikely((p = malloc(size)) == NULL))
+        count_error(&errcount.mem, "Malloc error");
+    return p;
+}
+
+static inline void *Realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (unlikely((p = realloc(ptr, size)) == NULL))
+        count_error(&errcount.mem, "Realloc error");
+    return p;
+}
+
+static inline void *Calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (unlikely((p = calloc(nmemb, size)) == NULL))
+        count_error(&errcount.mem, "Calloc error");
+    return p;
+}
+
+static inline void Free(void *ptr)
+{
+    free(ptr);
+}
+
+/* POSIX semaphore wrappers */
+static inline void Sem_wait(sem_t *sem)
+{
+    if (unlikely(sem_wait(sem) < 0))
+        count_error(&errcount.sem, "P error");
+}
+
+static inline void Sem_post(sem_t *sem)
+{
+    if (unlikely(sem_post(sem) < 0))
+        count_error(&errcount.sem, "V error");
+}
+
+/* csapp semaphores: take a unit with one compare-and-swap if there is
+   one, wake a sleeper only if there is one */
+static inline void csem_wait(csem_t *sem)
+{
+    int c = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+
+    if (likely(c > 0 && __atomic_compare_exchange_n(&sem->count, &c, c - 1, 0,
+                                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+        return;
+    csem_wait_slow(sem);
+}
+
+static inline void csem_post(csem_t *sem)
+{
+    __atomic_fetch_add(&sem->count, 1, __ATOMIC_SEQ_CST);
+    if (unlikely(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0))
+        csem_wake(sem);
+}
 
+/* P and V take either kind of semaphore */
+#define P(s) _Generic((s), sem_t *: Sem_wait, csem_t *: csem_wait)(s)
+#define V(s) _Generic((s), sem_t *: Sem_post, csem_t *: csem_post)(s)
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
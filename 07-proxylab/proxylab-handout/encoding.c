@@ -0,0 +1,54 @@
+/* Kept free of csapp.h so the proxy and tiny, which each have their own
+ * copy of it, can build the same file. */
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "encoding.h"
+
+#define IS_WS(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/* Length of the token at p, up to a separator or whitespace. */
+static size_t token(const char *p){
+    size_t n = 0;
+
+    while(p[n] && p[n] != ',' && p[n] != ';' && p[n] != '=' && !IS_WS(p[n])) n++;
+    return n;
+}
+
+/* Whether an Accept-Encoding value allows gzip: it is listed (as gzip or
+ * x-gzip) without q=0, or not listed and "*" is, without q=0. Whitespace, and the line end the caller may have
+ * left on value, is allowed around ',', ';' and '='. */
+int accepts_gzip(const char *value){
+    const char *p = value, *name, *param;
+    size_t n, pn;
+    int is_gzip, refused, star = 0;
+
+    while(*p){
+        while(*p == ',' || IS_WS(*p)) p++;
+        name = p;
+        n = token(p);
+        p += n;
+        is_gzip = (n == 4 && !strncasecmp(name, "gzip", 4)) ||
+                  (n == 6 && !strncasecmp(name, "x-gzip", 6));
+        refused = 0;
+        // parameters: *( OWS ";" OWS name OWS "=" OWS value )
+        while(1){
+            while(IS_WS(*p)) p++;
+            if(*p != ';') break;
+            for(p++; IS_WS(*p); p++);
+            param = p;
+            pn = token(p);
+            for(p += pn; IS_WS(*p); p++);
+            if(*p != '=') continue;
+            for(p++; IS_WS(*p); p++);
+            if(pn == 1 && (*param == 'q' || *param == 'Q'))
+                refused = strtod(p, NULL) <= 0;
+            p += token(p);
+        }
+        if(is_gzip) return !refused;
+        if(n == 1 && *name == '*') star = !refused;
+        // skip whatever is left of a malformed element.
+        while(*p && *p != ',') p++;
+    }
+    return star;
+}
@@ -0,0 +1,7 @@
+#ifndef __ENCODING_H__
+#define __ENCODING_H__
+
+/* Accept-Encoding parsing, shared with tiny, which builds ../encoding.c */
+int accepts_gzip(const char *value);
+
+#endif
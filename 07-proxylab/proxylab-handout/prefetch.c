@@ -0,0 +1,146 @@
+#include "prefetch.h"
+#include "compress.h"
+
+void pfbuf_init(pfbuf_t *pp, int n, long budget){
+    pp->buf = Calloc(n, sizeof(pfjob_t));
+    pp->n = n;
+    pp->front = pp->rear = pp->count = 0;
+    pp->budget = budget;
+    pp->used = 0;
+    pp->window = time(NULL);
+    csem_init(&pp->mutex, 1);
+    csem_init(&pp->items, 0);
+}
+
+void pfbuf_destory(pfbuf_t *pp){
+    Free(pp->buf);
+}
+
+/* Queue a resource, return -1 and drop it if the queue is full. */
+int pfbuf_add(pfbuf_t *pp, char *host, char *port, char *path){
+    P(&pp->mutex);
+    if(pp->count == pp->n){
+        V(&pp->mutex);
+        return -1;
+    }
+    strcpy(pp->buf[pp->rear].host, host);
+    strcpy(pp->buf[pp->rear].port, port);
+    strcpy(pp->buf[pp->rear].path, path);
+    pp->rear = (pp->rear + 1) % pp->n;
+    pp->count++;
+    V(&pp->mutex);
+    V(&pp->items);
+    return 0;
+}
+
+void pfbuf_remove(pfbuf_t *pp, pfjob_t *job){
+    P(&pp->items);
+    P(&pp->mutex);
+    *job = pp->buf[pp->front];
+    pp->front = (pp->front + 1) % pp->n;
+    pp->count--;
+    V(&pp->mutex);
+}
+
+/* Whether this second's byte budget has room left. */
+int pfbuf_budget(pfbuf_t *pp){
+    time_t now = time(NULL);
+    int ok;
+
+    P(&pp->mutex);
+    if(now != pp->window){
+        pp->window = now;
+        pp->used = 0;
+    }
+    ok = pp->used < pp->budget;
+    V(&pp->mutex);
+    return ok;
+}
+
+void pfbuf_spend(pfbuf_t *pp, long n){
+    P(&pp->mutex);
+    pp->used += n;
+    V(&pp->mutex);
+}
+
+/* Resolve link, found on page path of host:port, to a path on the same
+ * origin. Return 0 for links elsewhere or to other schemes. */
+static int resolve_link(char *link, size_t len, char *host, char *port, char *path, char *dest){
+    char buf[MAXLINE], *p, *q, *c;
+    size_t n, hlen;
+
+    if(len == 0 || len >= MAXLINE) return 0;
+    memcpy(buf, link, len);
+    buf[len] = '\0';
+    if((p = strchr(buf, '#')) != NULL) *p = '\0';
+    if(buf[0] == '\0') return 0;
+
+    p = buf;
+    if(!strncasecmp(p, "http://", 7)) p += 5;
+    if(!strncmp(p, "//", 2)){
+        // absolute link, keep it only if host and port match.
+        p += 2;
+        n = strcspn(p, "/?");
+        q = p + n;
+        c = memchr(p, ':', n);
+        hlen = c ? (size_t)(c - p) : n;
+        if(strlen(host) != hlen || strncasecmp(p, host, hlen)) return 0;
+        if(c ? (strlen(port) != q - c - 1 || strncmp(c + 1, port, q - c - 1)) : strcmp(port, "80"))
+            return 0;
+        if(*q == '/') strcpy(dest, q);
+        else sprintf(dest, "/%s", q);
+        return 1;
+    }
+    // other schemes such as https:, data:, mailto:, javascript:
+    for(q = p; *q && *q != '/' && *q != '?'; q++){
+        if(*q == ':') return 0;
+    }
+    if(*p == '/'){
+        strcpy(dest, p);
+        return 1;
+    }
+    // relative link, relative to the directory of the page.
+    n = strcspn(path, "?");
+    while(n > 0 && path[n-1] != '/') n--;
+    if(n == 0 || n + strlen(p) >= MAXLINE) return 0;
+    memcpy(dest, path, n);
+    strcpy(dest + n, p);
+    return 1;
+}
+
+/* Queue the same-origin src= and href= links of an HTML response fetched
+ * from host:port/path, return the number queued. */
+int prefetch_scan(pfbuf_t *pp, char *content, size_t length, char *host, char *port, char *path){
+    long body = response_body(content, length);
+    char *p, *end = content + length, *value, *type, link[MAXLINE];
+    size_t n, vlen;
+    int queued = 0;
+
+    if(body < 0) return 0;
+    type = response_header(content, body, "Content-Type", &vlen);
+    if(type == NULL || vlen < 9 || strncasecmp(type, "text/html", 9)) return 0;
+
+    for(p = content + body; p < end && queued < PREFETCH_MAX_LINKS; p++){
+        // the attribute name must start a word, as in <img src=...>
+        if(!isspace(p[-1])) continue;
+        if(end - p > 4 && !strncasecmp(p, "src=", 4)) value = p + 4;
+        else if(end - p > 5 && !strncasecmp(p, "href=", 5)) value = p + 5;
+        else continue;
+
+        if(*value == '"' || *value == '\''){
+            char *close = memchr(value + 1, *value, end - value - 1);
+            if(close == NULL) break;
+            n = close - value - 1;
+            value++;
+        }
+        else{
+            for(n = 0; value + n < end && !isspace(value[n]) && value[n] != '>'; n++);
+        }
+        if(resolve_link(value, n, host, port, path, link) && strcmp(link, path)){
+            if(pfbuf_add(pp, host, port, link) < 0) break;
+            queued++;
+        }
+        p = value + n - 1;
+    }
+    return queued;
+}
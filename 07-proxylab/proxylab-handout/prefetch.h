@@ -0,0 +1,39 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "csapp.h"
+
+/* Links taken from a single page */
+#define PREFETCH_MAX_LINKS 16
+
+typedef struct {
+    char host[MAXLINE];
+    char port[MAXLINE];
+    char path[MAXLINE];
+} pfjob_t;
+
+/* Bounded queue of same-origin resources to warm, with a byte budget
+ * that is refilled every second. */
+typedef struct {
+    pfjob_t *buf;
+    int n;
+    int front;
+    int rear;
+    int count;
+    long budget;
+    long used;
+    time_t window;
+    csem_t mutex;
+    csem_t items;
+} pfbuf_t;
+
+void pfbuf_init(pfbuf_t *pp, int n, long budget);
+void pfbuf_destory(pfbuf_t *pp);
+int pfbuf_add(pfbuf_t *pp, char *host, char *port, char *path);
+void pfbuf_remove(pfbuf_t *pp, pfjob_t *job);
+int pfbuf_budget(pfbuf_t *pp);
+void pfbuf_spend(pfbuf_t *pp, long n);
+
+int prefetch_scan(pfbuf_t *pp, char *content, size_t length, char *host, char *port, char *path);
+
+#endif
@@ -4,13 +4,29 @@
 #include "csapp.h"
 #include "sbuf.h"
 #include "cache.h"
+#include "compress.h"
+#include "affinity.h"
+#include "prefetch.h"
+#include "encoding.h"
 
 
 #define THREADS 8
 #define SBUFSIZE 32
 #define CACHE_NUM 10
+/* negative cache for failed origins and error responses */
+#define NEG_CACHE_NUM 4
+#define NEG_TTL 5
+/* pending gzip jobs */
+#define ZBUFSIZE 16
+/* pending prefetches, and bytes prefetched per second per node */
+#define PFBUFSIZE 64
+#define PREFETCH_BUDGET (1 << 20)
 /* max line of request content */
 #define MAX_CONTENT 128
+/* transform_request result for headers that do not fit in the request */
+#define REQ_TOO_LARGE -2
+/* rio buffer for responses relayed from origins, fewer reads per object */
+#define RELAY_BUFSIZE (64 * 1024)
 
 //#define DEBUG
 
@@ -24,47 +40,191 @@
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *my_version = "HTTP/1.0";
 
+typedef struct node node_t;
+
 void *thread(void *vargp);
-void doit(int fd);
-int transform_request(rio_t *rp, char *content, char*host, char*port, char*path);
+void *node_thread(void *vargp);
+void *signal_thread(void *vargp);
+void report_errors(void);
+void node_init(node_t *np);
+void accept_loop(node_t *np);
+void snapshot_file(char *dest, int node);
+void doit(node_t *np, int fd);
+void *prefetch_thread(void *vargp);
+void cache_response(node_t *np, char *finger, char *content, size_t length);
+int transform_request(rio_t *rp, char *content, size_t size, char*host, char*port, char*path, int *gzip);
 void parse_url(char *url, char*host, char*port, char*path);
 int read_all(rio_t *rp, void *content, size_t *length);
 void proxy_error(int fd);
-
-sbuf_t sbuf;
-cache_t cache;
+void too_large_error(int fd);
+size_t bad_gateway(char *buf);
+int response_status(char *content, size_t length);
+
+/* Per NUMA node serving state. Without -a there is a single node. */
+struct node {
+    int id;
+    int listenfd;
+    sbuf_t sbuf;
+    zbuf_t zbuf;
+    pfbuf_t pfbuf;
+    cache_t cache, neg_cache;
+};
+
+typedef struct {
+    node_t *np;
+    int cpu;
+} worker_t;
+
+node_t *nodes;
+int num_nodes = 1;
+/* pin workers to cores, one listener and cache shard per node (-a) */
+int use_affinity = 0;
+sem_t nodes_ready;
+char *listen_port;
+int neg_ttl = NEG_TTL;
+/* prefetch threads per node (-p), 0 disables prefetching */
+int prefetch_threads = 0;
+/* cache snapshot file (-s) */
+char *snapshot_path = NULL;
+/* signals handled by signal_thread */
+sigset_t signal_mask;
+/* socket options (-o) for the listeners and the origin connections */
+sockopts_t sock_opts;
 
 
 int main(int argc, char * argv[])
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int opt;
     pthread_t tid;
 
     // igonre SIGPIPE
     Signal(SIGPIPE, SIG_IGN);
     //sigaction(SIGPIPE, &(struct sigaction){SIG_IGN}, NULL);
 
-    if (argc != 2){
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    while((opt = getopt(argc, argv, "s:n:ap:o:")) != -1){
+        switch(opt){
+        case 's':
+            snapshot_path = optarg;
+            break;
+        case 'n':
+            neg_ttl = atoi(optarg);
+            break;
+        case 'a':
+            use_affinity = 1;
+            break;
+        case 'p':
+            prefetch_threads = atoi(optarg);
+            break;
+        case 'o':
+            if(sockopts_parse(&sock_opts, optarg) < 0) argc = 0;
+            break;
+        default:
+            argc = 0;
+        }
+    }
+    if (optind != argc - 1){
+        fprintf(stderr, "Usage: %s [-a] [-s snapshot] [-n negative_ttl] [-p prefetch_threads] [-o sockopt[=value],...] <port>\n", argv[0]);
         return 0;
     }
-    PRINTLOG("Port: %s\n", argv[1]);
+    listen_port = argv[optind];
+    PRINTLOG("Port: %s\n", listen_port);
+
+    // only the signal thread receives these, block them before any thread starts.
+    Sigemptyset(&signal_mask);
+    Sigaddset(&signal_mask, SIGUSR1);
+    Sigaddset(&signal_mask, SIGINT);
+    Sigaddset(&signal_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signal_mask, NULL);
+
+    if(use_affinity && (num_nodes = numa_init()) < 0){
+        fprintf(stderr, "Failed to get cpu affinity, running without -a.\n");
+        use_affinity = 0;
+        num_nodes = 1;
+    }
+    // every node binds its own listener to the port and the kernel spreads connections.
+    if(use_affinity) sock_opts.reuseport = 1;
+    nodes = (node_t *)Calloc(num_nodes, sizeof(node_t));
+    Sem_init(&nodes_ready, 0, 0);
+    for (int i = 0; i < num_nodes; i++){
+        nodes[i].id = i;
+    }
+    for (int i = 1; i < num_nodes; i++){
+        Pthread_create(&tid, NULL, node_thread, &nodes[i]);
+    }
+    node_init(&nodes[0]);
+    for (int i = 1; i < num_nodes; i++){
+        P(&nodes_ready);
+    }
+    PRINTLOG("%d node(s) ready.\n", num_nodes);
+    Pthread_create(&tid, NULL, signal_thread, NULL);
 
-    listenfd = Open_listenfd(argv[1]);
+    accept_loop(&nodes[0]);
 
-    sbuf_init(&sbuf, SBUFSIZE);
-    cache_init(&cache, CACHE_NUM);
+    // never get here.
+    for (int i = 0; i < num_nodes; i++){
+        subf_destory(&nodes[i].sbuf);
+        zbuf_destory(&nodes[i].zbuf);
+        pfbuf_destory(&nodes[i].pfbuf);
+        cache_destory(&nodes[i].cache);
+        cache_destory(&nodes[i].neg_cache);
+    }
+    Free(nodes);
+    return 0;
+}
+
+/* Set up a node from a thread running on it, so that its cache shard,
+ * queues and threads (which inherit the affinity) all stay node-local. */
+void node_init(node_t *np){
+    char path[MAXLINE];
+    pthread_t tid;
+    worker_t *wp;
+
+    if(use_affinity) pin_node(np->id);
+    np->listenfd = Open_listenfd_opts(listen_port, &sock_opts);
+
+    sbuf_init(&np->sbuf, SBUFSIZE);
+    cache_init(&np->cache, CACHE_NUM);
+    cache_init(&np->neg_cache, NEG_CACHE_NUM);
+    if(snapshot_path){
+        snapshot_file(path, np->id);
+        if(cache_load(&np->cache, path) < 0)
+            PRINTLOG("No cache snapshot loaded from %s\n", path);
+    }
+    zbuf_init(&np->zbuf, ZBUFSIZE);
+    Pthread_create(&tid, NULL, compress_thread, &np->zbuf);
+    // the number of prefetch threads caps concurrent prefetches.
+    pfbuf_init(&np->pfbuf, PFBUFSIZE, PREFETCH_BUDGET);
+    for (int i = 0; i < prefetch_threads; i++){
+        Pthread_create(&tid, NULL, prefetch_thread, np);
+    }
     for (int i=0;i<THREADS; i++){
-        Pthread_create(&tid, NULL, thread, NULL);
+        wp = (worker_t *)Malloc(sizeof(worker_t));
+        wp->np = np;
+        wp->cpu = use_affinity ? node_cpu(np->id, i) : -1;
+        Pthread_create(&tid, NULL, thread, wp);
     }
+}
+
+void *node_thread(void *vargp){
+    node_t *np = (node_t *)vargp;
+
+    pthread_detach(pthread_self());
+    node_init(np);
+    V(&nodes_ready);
+    accept_loop(np);
+    return NULL;
+}
+
+void accept_loop(node_t *np){
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
 
     while (1)
     {
         clientlen = sizeof(clientaddr);
-        if((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0){
+        if((connfd = accept(np->listenfd, (SA *)&clientaddr, &clientlen)) < 0){
             PRINTLOG("Accept failed.\n");
             continue;
         }
@@ -73,49 +233,98 @@ int main(int argc, char * argv[])
             PRINTLOG("getnameinfo failed.\n");
             continue;
         }
-        sbuf_add(&sbuf, connfd);
-        PRINTLOG("Accepting connection from (%s, %s)\n", hostname, port);
+        sbuf_add(&np->sbuf, connfd);
+        PRINTLOG("Node %d accepting connection from (%s, %s)\n", np->id, hostname, port);
     }
-    
-    // never get here.
-    subf_destory(&sbuf);
-    cache_destory(&cache);
-    return 0;
 }
 
-
 void *thread(void *vargp){
+    worker_t *wp = (worker_t *)vargp;
+    node_t *np = wp->np;
+
     pthread_detach(pthread_self());
+    if(wp->cpu >= 0) pin_cpu(wp->cpu);
+    Free(wp);
     while(1){
         PRINTLOG("Client connection allocated.\n");
-        int connfd = sbuf_remove(&sbuf);
-        doit(connfd);
+        int connfd = sbuf_remove(&np->sbuf);
+        doit(np, connfd);
         close(connfd);
         PRINTLOG("Client connection closed.\n");
     }
 }
 
+/* Snapshot file of a node's cache shard: the -s path itself for node 0. */
+void snapshot_file(char *dest, int node){
+    if(node == 0) strcpy(dest, snapshot_path);
+    else sprintf(dest, "%s.%d", snapshot_path, node);
+}
+
+/* On SIGUSR1 dump the cache (with -s) and report errors, do the same
+ * before exiting on SIGINT/SIGTERM. */
+void *signal_thread(void *vargp){
+    char path[MAXLINE];
+    int sig;
+
+    pthread_detach(pthread_self());
+    while(1){
+        if(sigwait(&signal_mask, &sig) != 0) continue;
+        report_errors();
+        for (int i = 0; i < num_nodes && snapshot_path; i++){
+            snapshot_file(path, i);
+            if(cache_dump(&nodes[i].cache, path) < 0)
+                fprintf(stderr, "Cache snapshot to %s failed.\n", path);
+            else PRINTLOG("Cache saved to %s\n", path);
+        }
+        if(sig != SIGUSR1) exit(0);
+    }
+}
+
+/* Print the errors the csapp wrappers counted, if there were any. */
+void report_errors(void){
+    errcount_t ec;
+
+    errcount_total(&ec);
+    if(ec.sem == 0 && ec.mem == 0) return;
+    fprintf(stderr, "Errors: %lu semaphore, %lu allocation, last: %s: %s\n",
+            ec.sem, ec.mem, ec.last_msg, strerror(ec.last_errno));
+}
+
 /* Handle client request */
-void doit(int fd){
-    char host[MAXLINE], port[MAXLINE], path[MAXLINE], finger[MAXLINE];
+void doit(node_t *np, int fd){
+    char host[MAXLINE], port[MAXLINE], path[MAXLINE], finger[MAXLINE], host_finger[MAXLINE];
     char request_content[MAX_CONTENT * MAXLINE], response_content[MAX_OBJECT_SIZE];
     rio_t rio, lc_rio;
-    int local_client_fd;
+    int local_client_fd, gzip, rc;
     size_t n, total_size;
 
     Rio_readinitb(&rio, fd);
 
     // read until eof.
-    if(transform_request(&rio, request_content, host, port, path) <= 0){
-        proxy_error(fd);
+    if((rc = transform_request(&rio, request_content, sizeof(request_content), host, port, path, &gzip)) <= 0){
+        rio_freeb(&rio);
+        if(rc == REQ_TOO_LARGE) too_large_error(fd);
+        else proxy_error(fd);
         return;
     }
+    // nothing more is read from the client, its buffer can go back to the pool.
+    rio_freeb(&rio);
     PRINTLOG("Request info: %s %s %s\n", host, port, path);
-    sprintf(finger, "%s %s %s", host, port, path);
+    // a key that does not fit would alias another url's.
+    if(snprintf(finger, MAXLINE, "%s %s %s", host, port, path) >= MAXLINE ||
+       snprintf(host_finger, MAXLINE, "%s %s", host, port) >= MAXLINE){
+        proxy_error(fd);
+        return;
+    }
     
-    // try to get the content from cache.
+    // try to get the content from cache, gzip variant first if the client
+    // takes it, then from the negative cache of recent error responses and
+    // unreachable origins.
     PRINTLOG("Searching cache...\n");
-    if(get_obj(&cache, finger, response_content, &total_size)>=0){
+    if((gzip && get_variant(&np->cache, finger, response_content, &total_size)>=0) ||
+       get_obj(&np->cache, finger, response_content, &total_size)>=0 ||
+       get_obj(&np->neg_cache, finger, response_content, &total_size)>=0 ||
+       get_obj(&np->neg_cache, host_finger, response_content, &total_size)>=0){
         PRINTLOG("Cache hit!\n");
         if(rio_writen(fd, response_content, total_size) == total_size){
             PRINTLOG("Finish this request by cache.\n");} 
@@ -124,12 +333,14 @@ void doit(int fd){
     }
 
     PRINTLOG("Cache miss.\n");
-    if((local_client_fd = open_clientfd(host, port)) <= 0){
+    if((local_client_fd = open_clientfd_opts(host, port, &sock_opts)) <= 0){
         PRINTLOG("Open remote socket failed.\n");
-        proxy_error(fd);
+        total_size = bad_gateway(response_content);
+        rio_writen(fd, response_content, total_size);
+        if(neg_ttl > 0) store_obj_ttl(&np->neg_cache, host_finger, response_content, total_size, neg_ttl);
         return;
     }
-    rio_readinitb(&lc_rio, local_client_fd);
+    rio_readinitb_size(&lc_rio, local_client_fd, RELAY_BUFSIZE);
     PRINTLOG("Sending Request...\n");
     if(rio_writen(local_client_fd, request_content, strlen(request_content))!=strlen(request_content)){
         proxy_error(fd);
@@ -144,18 +355,22 @@ void doit(int fd){
         if (rio_writen(fd, response_content, n) != n){
             PRINTLOG("Error happen while writing back to client.\n");
             close(local_client_fd);
+            rio_freeb(&lc_rio);
             return;
         }
         PRINTLOG("Send to client %.3f MiB.\n", n/1024.0);   
         total_size += n;
     }
     close(local_client_fd);
+    rio_freeb(&lc_rio);
 
     if (total_size <= MAX_OBJECT_SIZE){
-        // cache this content
         PRINTLOG("Saving cache...\n");
-        store_obj(&cache, finger, response_content, total_size);
+        cache_response(np, finger, response_content, total_size);
         PRINTLOG("Cache saved: %s\n", finger);
+        // links in error pages are not worth fetching.
+        if(prefetch_threads > 0 && response_status(response_content, total_size) / 100 == 2)
+            prefetch_scan(&np->pfbuf, response_content, total_size, host, port, path);
     }
 
     //Close(local_client_fd);
@@ -164,6 +379,62 @@ void doit(int fd){
 }
 
 
+/* Cache a complete response, error responses only for a short while. */
+void cache_response(node_t *np, char *finger, char *content, size_t length){
+    if(response_status(content, length) < 400){
+        store_obj(&np->cache, finger, content, length);
+        if(compressible(content, length))
+            zbuf_add(&np->zbuf, &np->cache, finger);
+    }
+    else if(neg_ttl > 0)
+        store_obj_ttl(&np->neg_cache, finger, content, length, neg_ttl);
+}
+
+/* Warm the cache with resources linked from recently fetched pages. */
+void *prefetch_thread(void *vargp){
+    node_t *np = (node_t *)vargp;
+    pfjob_t job;
+    char finger[MAXLINE], host_finger[MAXLINE], request_content[MAXLINE], extra;
+    char *response_content = Malloc(MAX_OBJECT_SIZE);
+    rio_t rio;
+    int clientfd;
+    size_t total_size;
+
+    pthread_detach(pthread_self());
+    while(1){
+        pfbuf_remove(&np->pfbuf, &job);
+        if(snprintf(finger, MAXLINE, "%s %s %s", job.host, job.port, job.path) >= MAXLINE ||
+           snprintf(host_finger, MAXLINE, "%s %s", job.host, job.port) >= MAXLINE ||
+           snprintf(request_content, MAXLINE, "GET %s %s\r\nHost: %s\r\n%sConnection: close\r\n"
+                    "Proxy-Connection: close\r\n\r\n", job.path, my_version, job.host,
+                    user_agent_hdr) >= MAXLINE)
+            continue;
+        // cached already, or known to fail.
+        if(get_obj(&np->cache, finger, response_content, &total_size) >= 0 ||
+           get_obj(&np->neg_cache, finger, response_content, &total_size) >= 0 ||
+           get_obj(&np->neg_cache, host_finger, response_content, &total_size) >= 0)
+            continue;
+        if(!pfbuf_budget(&np->pfbuf)){
+            PRINTLOG("Prefetch budget used up, skip %s\n", finger);
+            continue;
+        }
+        if((clientfd = open_clientfd_opts(job.host, job.port, &sock_opts)) < 0) continue;
+
+        rio_readinitb_size(&rio, clientfd, RELAY_BUFSIZE);
+        if(rio_writen(clientfd, request_content, strlen(request_content)) == strlen(request_content) &&
+           (total_size = rio_readnb(&rio, response_content, MAX_OBJECT_SIZE)) != -1 &&
+           rio_readnb(&rio, &extra, 1) == 0){
+            // only objects that fit in the cache are worth the bandwidth.
+            pfbuf_spend(&np->pfbuf, total_size);
+            cache_response(np, finger, response_content, total_size);
+            PRINTLOG("Prefetched: %s\n", finger);
+        }
+        close(clientfd);
+        rio_freeb(&rio);
+    }
+}
+
+
 // void doit_multi(int fd){
 //     char host[MAXLINE], port[MAXLINE], path[MAXLINE],
 //      last_host[MAXLINE]="\0", last_port[MAXLINE]="\0";
@@ -222,11 +493,15 @@ void doit(int fd){
 //     close(local_client_fd);
 // }
 
-/* Parse and transform client requesst */
-int transform_request(rio_t *rp, char *content, char*host, char*port, char*path){
-    char buf[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE];
+/* Parse and transform client requesst into content, a buffer of size bytes.
+ * Return REQ_TOO_LARGE if the headers do not fit. */
+int transform_request(rio_t *rp, char *content, size_t size, char*host, char*port, char*path, int *gzip){
+    char buf[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE], *line;
+    char *end = content + size;
     int contain_host = 0;
+    ssize_t n;
 
+    *gzip = 0;
     if(rio_readlineb(rp, buf, MAXLINE) <= 0) return -1;
     PRINTLOG("Origin Header: %s", buf);
 
@@ -239,31 +514,37 @@ int transform_request(rio_t *rp, char *content, char*host, char*port, char*path)
     PRINTLOG("Parse URL: %s %s %s\n", host, port, path);
 
     //int i = 0;
-    sprintf(buf, "%s %s %s\r\n", method, path, my_version);
-    strcpy(content, buf);
-    content += strlen(buf);
-    strcpy(content, user_agent_hdr);
-    content += strlen(user_agent_hdr);
-    while(rio_readlineb(rp, buf, MAXLINE) > 0){
-        if (strncmp("Proxy-Connection:", buf, strlen("Proxy-Connection:")) == 0) continue;
-        if (strncmp("Connection:", buf, strlen("Connection:")) == 0) continue;
-        if (strncmp("Host:", buf, strlen("Host:")) == 0) contain_host = 1;
-        strcpy(content, buf);
-        content += strlen(buf);
-        if(!strcmp(buf, "\r\n")) break;
+    n = snprintf(content, end - content, "%s %s %s\r\n%s", method, path, my_version, user_agent_hdr);
+    if(n >= end - content) return REQ_TOO_LARGE;
+    content += n;
+    // headers are looked at in the rio buffer and copied once, straight into content.
+    while((n = rio_peekline(rp, &line)) > 0){
+        // a line cut short by the end of the buffer is too long, by EOF incomplete.
+        if(line[n - 1] != '\n') return n >= RIO_MAXBUFSIZE ? REQ_TOO_LARGE : -1;
+        rio_consume(rp, n);
+        if (strncmp("Proxy-Connection:", line, strlen("Proxy-Connection:")) == 0) continue;
+        if (strncmp("Connection:", line, strlen("Connection:")) == 0) continue;
+        // the origin is always asked for identity bytes, the proxy compresses itself.
+        if (strncasecmp("Accept-Encoding:", line, strlen("Accept-Encoding:")) == 0){
+            line[n - 1] = '\0';
+            *gzip = accepts_gzip(line + strlen("Accept-Encoding:"));
+            continue;
+        }
+        if (strncmp("Host:", line, strlen("Host:")) == 0) contain_host = 1;
+        if(n >= end - content) return REQ_TOO_LARGE;
+        memcpy(content, line, n);
+        content += n;
+        if(n == 2 && !memcmp(line, "\r\n", 2)) break;
     }
 
     if(!contain_host){
-        sprintf(buf, "Host: %s\r\n", host);
-        strcpy(content, buf);
-        content += strlen(buf);
+        n = snprintf(content, end - content, "Host: %s\r\n", host);
+        if(n >= end - content) return REQ_TOO_LARGE;
+        content += n;
     }
 
-    sprintf(buf, "Connection: close\r\nProxy-Connection: close\r\n");
-    strcpy(content, buf);
-    content += strlen(buf);
-
-    *content = '\0';
+    n = snprintf(content, end - content, "Connection: close\r\nProxy-Connection: close\r\n");
+    if(n >= end - content) return REQ_TOO_LARGE;
 
     return 1;
 }
@@ -305,7 +586,29 @@ void parse_url(char *url, char*host, char*port, char*path){
 /* Sent the HTTP error to client. */
 void proxy_error(int fd){
     char buf[MAXLINE];
-    sprintf(buf, "%s %s\r\n\r\n",my_version ,"502 Bad-Gateway");
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<h1>502 Bad-Gateway<h1>\r\n");
+    rio_writen(fd, buf, bad_gateway(buf));
+}
+
+/* Tell the client its request headers are too large. */
+void too_large_error(int fd){
+    char buf[MAXLINE];
+    int n = sprintf(buf, "%s %s\r\n\r\n<h1>431 Request Header Fields Too Large</h1>\r\n",
+                    my_version, "431 Request Header Fields Too Large");
+    rio_writen(fd, buf, n);
+}
+
+/* Build the 502 response in buf, return its length. */
+size_t bad_gateway(char *buf){
+    return sprintf(buf, "%s %s\r\n\r\n<h1>502 Bad-Gateway<h1>\r\n", my_version, "502 Bad-Gateway");
+}
+
+/* Get the status code of a response, 0 if it has no valid status line. */
+int response_status(char *content, size_t length){
+    int status = 0;
+    char *p = memchr(content, ' ', length < MAXLINE ? length : MAXLINE);
+
+    if(length < 5 || strncmp(content, "HTTP/", 5) || p == NULL) return 0;
+    for(p++; p < content + length && isdigit(*p); p++)
+        status = status * 10 + (*p - '0');
+    return status;
 }
\ No newline at end of file
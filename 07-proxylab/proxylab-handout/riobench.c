@@ -0,0 +1,118 @@
+/*
+ * riobench.c - time rio_readlineb over header-heavy requests against
+ *     the byte-at-a-time loop it replaced
+ *
+ * usage: riobench [requests]
+ */
+#include "csapp.h"
+
+static char *headers[] = {
+    "Host: www.example.com\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8,fr;q=0.7\r\n",
+    "Accept-Encoding: gzip, deflate, br\r\n",
+    "Referer: https://www.example.com/articles/2019/10/some-long-article-title.html\r\n",
+    "Cookie: session=4f2a9c1e8b7d6a5f3e2d1c0b9a8f7e6d; theme=dark; _ga=GA1.2.1234567890.1571234567\r\n",
+    "Cache-Control: max-age=0\r\n",
+    "Upgrade-Insecure-Requests: 1\r\n",
+    "DNT: 1\r\n",
+    "Sec-Fetch-Site: same-origin\r\n",
+    "Sec-Fetch-Mode: navigate\r\n",
+    "Sec-Fetch-User: ?1\r\n",
+    "Sec-Fetch-Dest: document\r\n",
+    "If-None-Match: \"5d8c72a5edda8d6a:0\"\r\n",
+    "If-Modified-Since: Tue, 15 Oct 2019 12:45:26 GMT\r\n",
+    "X-Forwarded-For: 203.0.113.195, 70.41.3.18, 150.172.238.178\r\n",
+    "X-Request-Id: 9b2f6c4e-1d3a-4e5f-8a7b-6c5d4e3f2a1b\r\n",
+    "Connection: keep-alive\r\n",
+    "Proxy-Connection: keep-alive\r\n",
+};
+#define NHEADERS (sizeof(headers) / sizeof(headers[0]))
+
+/* What rio_readlineb did before: one read of the buffer per byte, here
+   through rio_readnb() since rio_read() is private to csapp.c */
+static ssize_t old_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++)
+    {
+        if ((rc = rio_readnb(rp, &c, 1)) == 1)
+        {
+            *bufp++ = c;
+            if (c == '\n')
+            {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0)
+        {
+            if (n == 1)
+                return 0; /* EOF, no data read */
+            else
+                break; /* EOF, some data was read */
+        }
+        else
+            return -1; /* Error */
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+/* Read every line of fd from the start, return the ns per line */
+static double run(ssize_t (*readline)(rio_t *, void *, size_t), int fd,
+                  long *lines, long *bytes)
+{
+    char buf[MAXLINE];
+    rio_t rio;
+    ssize_t n;
+    struct timespec start, end;
+
+    *lines = *bytes = 0;
+    Lseek(fd, 0, SEEK_SET);
+    Rio_readinitb(&rio, fd);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((n = readline(&rio, buf, MAXLINE)) > 0)
+    {
+        (*lines)++;
+        *bytes += n;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rio_freeb(&rio);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / *lines;
+}
+
+int main(int argc, char **argv)
+{
+    long requests = argc > 1 ? atol(argv[1]) : 20000, lines, bytes;
+    double old_ns, new_ns;
+    FILE *fp;
+    int fd;
+
+    /* A file stands in for the socket, so only the parsing is timed */
+    if ((fp = tmpfile()) == NULL)
+        unix_error("tmpfile error");
+    for (long i = 0; i < requests; i++)
+    {
+        fprintf(fp, "GET http://www.example.com/static/img/%ld.png HTTP/1.1\r\n", i);
+        for (int j = 0; j < NHEADERS; j++)
+            fputs(headers[j], fp);
+        fputs("\r\n", fp);
+    }
+    fflush(fp);
+    fd = fileno(fp);
+
+    run(old_readlineb, fd, &lines, &bytes); /* warm up */
+    run(rio_readlineb, fd, &lines, &bytes);
+    old_ns = run(old_readlineb, fd, &lines, &bytes);
+    new_ns = run(rio_readlineb, fd, &lines, &bytes);
+    printf("%ld lines, %.1f MB\n", lines, bytes / 1e6);
+    printf("byte at a time: %6.1f ns/line %6.2f GB/s\n", old_ns, bytes / (old_ns * lines));
+    printf("memchr:         %6.1f ns/line %6.2f GB/s\n", new_ns, bytes / (new_ns * lines));
+    printf("%.1fx faster\n", old_ns / new_ns);
+    fclose(fp);
+    return 0;
+}
@@ -4,9 +4,9 @@ void sbuf_init(sbuf_t *sp, int n){
     sp->buf = Calloc(n, sizeof(int));
     sp->n = n;
     sp->front = sp->rear = 0;
-    Sem_init(&sp->mutex, 0, 1);
-    Sem_init(&sp->items, 0, 0);
-    Sem_init(&sp->slots, 0, n);
+    csem_init(&sp->mutex, 1);
+    csem_init(&sp->items, 0);
+    csem_init(&sp->slots, n);
 }
 
 void subf_destory(sbuf_t *sp){
@@ -8,9 +8,9 @@ typedef struct {
     int n;
     int front;
     int rear;
-    sem_t mutex;
-    sem_t slots;
-    sem_t items;
+    csem_t mutex;
+    csem_t slots;
+    csem_t items;
 } sbuf_t;
 
 void sbuf_init(sbuf_t *sp, int n);
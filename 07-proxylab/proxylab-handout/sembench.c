@@ -0,0 +1,151 @@
+/*
+ * sembench.c - time P and V on a POSIX sem_t against a csem_t: alone,
+ *     as a mutex under contention, and handing items through a small
+ *     bounded buffer the way sbuf does
+ *
+ * usage: sembench [threads] [iterations]
+ */
+#include "csapp.h"
+
+#define QUEUE_SLOTS 16
+
+static long iters;
+static long counter;
+
+static double elapsed_ns(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+/* The same code for both kinds, P and V pick the right calls */
+#define SEM_BENCH(T, init)                                                 \
+    static T T##_mutex, T##_slots, T##_items;                              \
+    static int T##_queue[QUEUE_SLOTS];                                     \
+                                                                           \
+    static double T##_alone(void)                                          \
+    {                                                                      \
+        struct timespec start;                                             \
+                                                                           \
+        init(&T##_mutex, 1);                                               \
+        clock_gettime(CLOCK_MONOTONIC, &start);                            \
+        for (long i = 0; i < iters; i++)                                   \
+        {                                                                  \
+            P(&T##_mutex);                                                 \
+            counter++;                                                     \
+            V(&T##_mutex);                                                 \
+        }                                                                  \
+        return elapsed_ns(&start) / iters;                                 \
+    }                                                                      \
+                                                                           \
+    static void *T##_locker(void *vargp)                                   \
+    {                                                                      \
+        for (long i = 0; i < iters; i++)                                   \
+        {                                                                  \
+            P(&T##_mutex);                                                 \
+            counter++;                                                     \
+            V(&T##_mutex);                                                 \
+        }                                                                  \
+        return NULL;                                                       \
+    }                                                                      \
+                                                                           \
+    static double T##_contended(int nthreads)                              \
+    {                                                                      \
+        pthread_t tid[nthreads];                                           \
+        struct timespec start;                                             \
+                                                                           \
+        init(&T##_mutex, 1);                                               \
+        clock_gettime(CLOCK_MONOTONIC, &start);                            \
+        for (int i = 0; i < nthreads; i++)                                 \
+            Pthread_create(&tid[i], NULL, T##_locker, NULL);               \
+        for (int i = 0; i < nthreads; i++)                                 \
+            Pthread_join(tid[i], NULL);                                    \
+        return elapsed_ns(&start) / (iters * nthreads);                    \
+    }                                                                      \
+                                                                           \
+    static void *T##_consumer(void *vargp)                                 \
+    {                                                                      \
+        for (long i = 0; i < iters; i++)                                   \
+        {                                                                  \
+            P(&T##_items);                                                 \
+            P(&T##_mutex);                                                 \
+            counter += T##_queue[i % QUEUE_SLOTS];                         \
+            V(&T##_mutex);                                                 \
+            V(&T##_slots);                                                 \
+        }                                                                  \
+        return NULL;                                                       \
+    }                                                                      \
+                                                                           \
+    static double T##_handoff(void)                                        \
+    {                                                                      \
+        pthread_t tid;                                                     \
+        struct timespec start;                                             \
+                                                                           \
+        init(&T##_mutex, 1);                                               \
+        init(&T##_slots, QUEUE_SLOTS);                                     \
+        init(&T##_items, 0);                                               \
+        clock_gettime(CLOCK_MONOTONIC, &start);                            \
+        Pthread_create(&tid, NULL, T##_consumer, NULL);                    \
+        for (long i = 0; i < iters; i++)                                   \
+        {                                                                  \
+            P(&T##_slots);                                                 \
+            P(&T##_mutex);                                                 \
+            T##_queue[i % QUEUE_SLOTS] = 1;                                \
+            V(&T##_mutex);                                                 \
+            V(&T##_items);                                                 \
+        }                                                                  \
+        Pthread_join(tid, NULL);                                           \
+        return elapsed_ns(&start) / iters;                                 \
+    }
+
+static void posix_init(sem_t *sem, unsigned int value)
+{
+    Sem_init(sem, 0, value);
+}
+
+SEM_BENCH(sem_t, posix_init)
+SEM_BENCH(csem_t, csem_init)
+
+static void report(char *what, double sem_ns, double csem_ns)
+{
+    printf("%-22s %8.1f %8.1f   %5.1fx\n", what, sem_ns, csem_ns, sem_ns / csem_ns);
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    char what[MAXLINE];
+    double sem_ns, csem_ns;
+
+    iters = argc > 2 ? atol(argv[2]) : 2000000;
+    if (nthreads <= 0 || iters <= 0)
+    {
+        fprintf(stderr, "usage: %s [threads] [iterations]\n", argv[0]);
+        exit(1);
+    }
+
+    printf("%-22s %8s %8s\n", "ns per P+V", "sem_t", "csem_t");
+    sem_t_alone(); /* warm up */
+    csem_t_alone();
+    sem_ns = sem_t_alone();
+    csem_ns = csem_t_alone();
+    report("uncontended", sem_ns, csem_ns);
+
+    counter = 0;
+    sem_ns = sem_t_contended(nthreads);
+    csem_ns = csem_t_contended(nthreads);
+    if (counter != 2 * iters * nthreads)
+        app_error("sembench: lost an update under contention");
+    snprintf(what, sizeof(what), "mutex, %d threads", nthreads);
+    report(what, sem_ns, csem_ns);
+
+    counter = 0;
+    sem_ns = sem_t_handoff();
+    csem_ns = csem_t_handoff();
+    if (counter != 2 * iters)
+        app_error("sembench: lost an item in the hand-off");
+    report("bounded buffer hand-off", sem_ns, csem_ns);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "accesslog.h"
+
+static logring_t *rings;        /* every thread that has logged */
+static sem_t rings_mutex;
+static int log_fd;
+static __thread logring_t *my_ring;
+
+static void *flush_thread(void *vargp);
+
+/* Start the thread that writes the records out to fd. */
+void accesslog_init(int fd){
+    pthread_t tid;
+
+    log_fd = fd;
+    rings = NULL;
+    Sem_init(&rings_mutex, 0, 1);
+    Pthread_create(&tid, NULL, flush_thread, NULL);
+}
+
+static logring_t *new_ring(void){
+    logring_t *rp = Malloc(sizeof(logring_t));
+
+    atomic_init(&rp->head, 0);
+    atomic_init(&rp->tail, 0);
+    atomic_init(&rp->dropped, 0);
+    P(&rings_mutex);
+    rp->next = rings;
+    rings = rp;
+    V(&rings_mutex);
+    return rp;
+}
+
+/* Record a request line with its status and time, or a note with status 0.
+   Never blocks: with the ring full the record is dropped and counted. */
+void accesslog(char *request, int status, long usecs){
+    logring_t *rp = my_ring;
+    unsigned long head;
+    logrec_t *rec;
+    size_t n;
+
+    if(rp == NULL) rp = my_ring = new_ring();
+    head = atomic_load_explicit(&rp->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&rp->tail, memory_order_acquire) == LOG_RING){
+        atomic_fetch_add_explicit(&rp->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    rec = &rp->recs[head & (LOG_RING - 1)];
+    clock_gettime(CLOCK_REALTIME, &rec->when);
+    rec->status = status;
+    rec->usecs = usecs;
+    n = strcspn(request, "\r\n");
+    if(n >= LOG_REQUEST) n = LOG_REQUEST - 1;
+    memcpy(rec->request, request, n);
+    rec->request[n] = '\0';
+    // publish the record to the flusher.
+    atomic_store_explicit(&rp->head, head + 1, memory_order_release);
+}
+
+/* Format the records of rp into buf, writing buf out whenever it fills. */
+static size_t drain(logring_t *rp, char *buf, size_t len){
+    unsigned long tail = atomic_load_explicit(&rp->tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&rp->head, memory_order_acquire);
+    unsigned long dropped;
+    char date[64];
+    struct tm tm;
+
+    for(; tail != head; tail++){
+        logrec_t *rec = &rp->recs[tail & (LOG_RING - 1)];
+
+        if(len > MAXBUF - LOG_REQUEST - 128){
+            rio_writen(log_fd, buf, len);
+            len = 0;
+        }
+        localtime_r(&rec->when.tv_sec, &tm);
+        strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+        if(rec->status)
+            len += sprintf(buf + len, "[%s] \"%s\" %d %ldus\n", date, rec->request,
+                           rec->status, rec->usecs);
+        else
+            len += sprintf(buf + len, "[%s] %s\n", date, rec->request);
+        // the slot is the thread's again once tail moves past it.
+        atomic_store_explicit(&rp->tail, tail + 1, memory_order_release);
+    }
+    if((dropped = atomic_exchange_explicit(&rp->dropped, 0, memory_order_relaxed)) != 0)
+        len += sprintf(buf + len, "access log: dropped %lu records\n", dropped);
+    return len;
+}
+
+static void *flush_thread(void *vargp){
+    char buf[MAXBUF];
+    struct timespec interval = { 0, LOG_INTERVAL * 1000000L };
+    logring_t *rp;
+    size_t len;
+
+    Pthread_detach(pthread_self());
+    while(1){
+        nanosleep(&interval, NULL);
+        P(&rings_mutex);
+        rp = rings;
+        V(&rings_mutex);
+        // rings are only ever pushed at the front, the rest of the list is stable.
+        for(len = 0; rp; rp = rp->next) len = drain(rp, buf, len);
+        if(len > 0) rio_writen(log_fd, buf, len);
+    }
+    return NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include <stdatomic.h>
+#include "csapp.h"
+
+#define LOG_RING     1024 /* records per thread, a power of 2 */
+#define LOG_REQUEST  120  /* bytes of the request line kept */
+#define LOG_INTERVAL 100  /* ms between flushes */
+
+typedef struct {
+    struct timespec when;
+    int status;                 /* 0 for a note that is not a request */
+    long usecs;                 /* time to answer the request */
+    char request[LOG_REQUEST];
+} logrec_t;
+
+/* One thread's records, written only by it and read only by the flusher */
+typedef struct logring {
+    logrec_t recs[LOG_RING];
+    atomic_ulong head;          /* next record the thread writes */
+    atomic_ulong tail;          /* next record the flusher reads */
+    atomic_ulong dropped;       /* records lost to a full ring */
+    struct logring *next;
+} logring_t;
+
+void accesslog_init(int fd);
+void accesslog(char *request, int status, long usecs);
+
+#endif
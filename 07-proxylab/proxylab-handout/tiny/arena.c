@@ -0,0 +1,170 @@
+#include "arena.h"
+
+typedef struct {
+    char *filename;
+    off_t size;
+} afile_t;
+
+static arena_t *current = NULL;
+static sem_t mutex;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void init_mutex(void){
+    Sem_init(&mutex, 0, 1);
+}
+
+static unsigned long hash(char *s){
+    unsigned long h = 5381;
+
+    while(*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+/* Add the small regular files under path to files, cgi-bin is served dynamically. */
+static void collect(char *path, afile_t **files, int *n, int *cap, size_t *total){
+    char child[MAXLINE];
+    struct dirent *de;
+    struct stat st;
+    DIR *dirp;
+
+    if((dirp = opendir(path)) == NULL) return;
+    while((de = readdir(dirp)) != NULL){
+        if(de->d_name[0] == '.') continue;
+        if(snprintf(child, MAXLINE, "%s/%s", path, de->d_name) >= MAXLINE) continue;
+        if(lstat(child, &st) < 0) continue;
+        if(S_ISDIR(st.st_mode)){
+            if(strcmp(de->d_name, "cgi-bin")) collect(child, files, n, cap, total);
+            continue;
+        }
+        if(!S_ISREG(st.st_mode) || !(S_IRUSR & st.st_mode) || st.st_size > ARENA_MAXFILE) continue;
+        if(*total + st.st_size > ARENA_MAXTOTAL) continue;
+        if(*n == *cap){
+            *cap = *cap ? *cap * 2 : 64;
+            *files = Realloc(*files, *cap * sizeof(afile_t));
+        }
+        (*files)[*n].filename = Malloc(strlen(child) + 1);
+        strcpy((*files)[*n].filename, child);
+        (*files)[*n].size = st.st_size;
+        (*n)++;
+        *total += st.st_size;
+    }
+    closedir(dirp);
+}
+
+/* Read exactly size bytes of filename into dest. */
+static int read_file(char *filename, char *dest, off_t size){
+    int fd;
+    ssize_t n;
+
+    if((fd = open(filename, O_RDONLY, 0)) < 0) return -1;
+    n = rio_readn(fd, dest, size);
+    close(fd);
+    return n == size ? 0 : -1;
+}
+
+/* Preload the files under dir (relative to the document root ".") into a
+ * single mapping laid out as filename, headers, body for each file, so a
+ * hit is served with one write. Return NULL if nothing could be loaded. */
+arena_t *arena_load(char *dir, arena_hdr_t *hdr){
+    char root[MAXLINE], buf[MAXBUF];
+    afile_t *files = NULL;
+    int n = 0, cap = 0;
+    size_t total = 0, off = 0;
+    arena_t *ap;
+
+    while(!strncmp(dir, "./", 2)) dir += 2;
+    if(!strcmp(dir, ".") || dir[0] == '\0') strcpy(root, ".");
+    else snprintf(root, MAXLINE, "./%s", dir);
+    if(root[strlen(root) - 1] == '/') root[strlen(root) - 1] = '\0';
+
+    collect(root, &files, &n, &cap, &total);
+    if(n == 0){
+        Free(files);
+        return NULL;
+    }
+    for(int i = 0; i < n; i++){
+        total += strlen(files[i].filename) + 1 + hdr(buf, MAXBUF, files[i].filename, files[i].size);
+    }
+
+    ap = Malloc(sizeof(arena_t));
+    ap->size = total;
+    ap->base = Mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ap->assets = Malloc(n * sizeof(asset_t));
+    ap->n = 0;
+    ap->refcnt = 0;
+    ap->retired = 0;
+    for(ap->nslots = 1; ap->nslots < 2 * n; ap->nslots <<= 1);
+    ap->slots = Calloc(ap->nslots, sizeof(int));
+
+    for(int i = 0; i < n; i++){
+        asset_t *a = &ap->assets[ap->n];
+        size_t hlen;
+
+        a->filename = ap->base + off;
+        strcpy(a->filename, files[i].filename);
+        a->data = a->filename + strlen(a->filename) + 1;
+        hlen = hdr(a->data, total - (a->data - ap->base), files[i].filename, files[i].size);
+        // skip files that changed size or vanished since they were listed.
+        if(read_file(files[i].filename, a->data + hlen, files[i].size) == 0){
+            a->hdrlen = hlen;
+            a->len = hlen + files[i].size;
+            off = a->data + a->len - ap->base;
+            unsigned long s = hash(a->filename) & (ap->nslots - 1);
+            while(ap->slots[s]) s = (s + 1) & (ap->nslots - 1);
+            ap->slots[s] = ++ap->n;
+        }
+        Free(files[i].filename);
+    }
+    Free(files);
+    mprotect(ap->base, ap->size, PROT_READ);
+    return ap;
+}
+
+void arena_free(arena_t *ap){
+    Munmap(ap->base, ap->size);
+    Free(ap->assets);
+    Free(ap->slots);
+    Free(ap);
+}
+
+asset_t *arena_find(arena_t *ap, char *filename){
+    unsigned long s = hash(filename) & (ap->nslots - 1);
+
+    for(; ap->slots[s]; s = (s + 1) & (ap->nslots - 1)){
+        asset_t *a = &ap->assets[ap->slots[s] - 1];
+        if(!strcmp(a->filename, filename)) return a;
+    }
+    return NULL;
+}
+
+/* Make ap the live arena, the old one is freed once its last request is done. */
+void arena_publish(arena_t *ap){
+    arena_t *old;
+
+    pthread_once(&once, init_mutex);
+    P(&mutex);
+    old = current;
+    current = ap;
+    if(old){
+        old->retired = 1;
+        if(old->refcnt == 0) arena_free(old);
+    }
+    V(&mutex);
+}
+
+/* Return the live arena, or NULL if there is none; give it back with arena_release. */
+arena_t *arena_acquire(void){
+    arena_t *ap;
+
+    pthread_once(&once, init_mutex);
+    P(&mutex);
+    if((ap = current) != NULL) ap->refcnt++;
+    V(&mutex);
+    return ap;
+}
+
+void arena_release(arena_t *ap){
+    P(&mutex);
+    if(--ap->refcnt == 0 && ap->retired) arena_free(ap);
+    V(&mutex);
+}
@@ -0,0 +1,39 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+#define ARENA_MAXFILE  (256 * 1024)        /* Larger files stay on disk */
+#define ARENA_MAXTOTAL (64 * 1024 * 1024)  /* Bytes preloaded at most */
+
+/* Writes the response headers of a file into buf, returns their length */
+typedef int arena_hdr_t(char *buf, size_t size, char *filename, off_t filesize);
+
+typedef struct {
+    char *filename;  /* key, "./dir/file" as built by parse_uri */
+    char *data;      /* response headers immediately followed by the body */
+    size_t hdrlen;   /* bytes of data that are headers */
+    size_t len;
+} asset_t;
+
+/* A directory tree preloaded into one read-only mapping */
+typedef struct {
+    char *base;
+    size_t size;
+    asset_t *assets;
+    int n;
+    int *slots;      /* open addressing hash, asset index + 1, 0 if empty */
+    int nslots;
+    int refcnt;      /* requests still serving from it */
+    int retired;     /* replaced by a newer arena */
+} arena_t;
+
+arena_t *arena_load(char *dir, arena_hdr_t *hdr);
+void arena_free(arena_t *ap);
+asset_t *arena_find(arena_t *ap, char *filename);
+
+void arena_publish(arena_t *ap);
+arena_t *arena_acquire(void);
+void arena_release(arena_t *ap);
+
+#endif
@@ -1,17 +1,41 @@
 /*
- * adder.c - a minimal CGI program that adds two numbers together
+ * adder.c - a minimal CGI program that adds two numbers together.
+ *     Started by tiny's worker pool it stays up and answers requests
+ *     over the socket on its stdin instead.
  */
 /* $begin adder */
 #include "csapp.h"
+#include "fcgi.h"
+
+int respond(char *out);
 
 int main(void) {
+    char out[MAXBUF];
+
+    if (fcgi_worker()) {
+	while (fcgi_accept() == 0)
+	    if (fcgi_reply(out, respond(out)) < 0)
+		break;
+	exit(0);
+    }
+
+    /* Generate the HTTP response */
+    fwrite(out, 1, respond(out), stdout);
+    fflush(stdout);
+    exit(0);
+}
+
+/*
+ * respond - write the response for QUERY_STRING into out, return
+ *     its length
+ */
+int respond(char *out) {
     char *buf, *p;
     char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
-    int n1=0, n2=0;
+    int n1=0, n2=0, n;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
+    if ((buf = getenv("QUERY_STRING")) != NULL && (p = strchr(buf, '&')) != NULL) {
 	*p = '\0';
 	strcpy(arg1, buf);
 	strcpy(arg2, p+1);
@@ -20,19 +44,16 @@ int main(void) {
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
-    /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+    n = snprintf(content, sizeof(content), "Welcome to add.com: ");
+    n += snprintf(content + n, sizeof(content) - n,
+		  "THE Internet addition portal.\r\n<p>");
+    n += snprintf(content + n, sizeof(content) - n,
+		  "The answer is: %d + %d = %d\r\n<p>", n1, n2, n1 + n2);
+    n += snprintf(content + n, sizeof(content) - n, "Thanks for visiting!\r\n");
 
-    exit(0);
+    return sprintf(out, "Connection: close\r\n"
+		   "Content-length: %d\r\n"
+		   "Content-type: text/html\r\n\r\n"
+		   "%s", n, content);
 }
 /* $end adder */
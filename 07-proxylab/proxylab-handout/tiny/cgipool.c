@@ -0,0 +1,202 @@
+#include "cgipool.h"
+
+static cgiprog_t progs[CGI_MAXPROGS];
+static int nprogs, nworkers;
+static sem_t mutex;  /* protects progs and nprogs */
+
+/*
+ * cgipool_init - workers are started on the first request for a
+ *     program, nworkers each; 0 turns the pool off
+ */
+void cgipool_init(int n)
+{
+    nworkers = n < CGI_MAXWORKERS ? n : CGI_MAXWORKERS;
+    nprogs = 0;
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * is_worker - whether filename names a persistent worker, by its
+ *     suffix. Plain CGI programs are never started as workers, they
+ *     would run for real.
+ */
+static int is_worker(char *filename)
+{
+    size_t n = strlen(filename), sn = strlen(CGI_WORKER_SUFFIX);
+
+    return n > sn && !strcmp(filename + n - sn, CGI_WORKER_SUFFIX);
+}
+
+/*
+ * spawn - start filename as a worker, with its end of the socket as
+ *     stdin, and wait for it to say it is ready. Its pid and tiny's
+ *     end of the socket go to *pidp and *fdp, even if it never does.
+ */
+static int spawn(char *filename, int *fdp, pid_t *pidp)
+{
+    int sv[2];
+    char *emptylist[] = { NULL }, *hello;
+    size_t len;
+    struct pollfd pfd;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+	unix_error("socketpair error");
+    if ((*pidp = Fork()) == 0) {
+	Dup2(sv[1], STDIN_FILENO);
+	Dup2(Open("/dev/null", O_WRONLY, 0), STDOUT_FILENO);
+	/* Outliving the request, it must not hold the client's connection
+	   or anything else of tiny's open */
+	close_from(STDERR_FILENO + 1);
+	setenv(FCGI_ENV, "1", 1);
+	Execve(filename, emptylist, environ);
+    }
+    Close(sv[1]);
+    *fdp = sv[0];
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, CGI_STARTUP) <= 0 || (hello = fcgi_recv(sv[0], &len)) == NULL)
+	return -1;
+    free(hello);
+    return 0;
+}
+
+/*
+ * reap - kill a worker and wait for it
+ */
+static void reap(int fd, pid_t pid)
+{
+    Close(fd);
+    kill(pid, SIGKILL);
+    Waitpid(pid, NULL, 0);
+}
+
+/* A worker to replace, handed to a thread of its own */
+typedef struct {
+    cgiprog_t *cp;
+    int slot;      /* its index in cp->fds and cp->pids */
+} respawn_t;
+
+/*
+ * respawn_thread - stop the worker in job->slot and start a new one in
+ *     its place, off the request that found it dead
+ */
+static void *respawn_thread(void *vargp)
+{
+    respawn_t *job = vargp;
+    cgiprog_t *cp = job->cp;
+    int i = job->slot, fd, newfd;
+    pid_t pid;
+
+    Pthread_detach(pthread_self());
+    Free(job);
+    P(&mutex);
+    fd = cp->fds[i];
+    pid = cp->pids[i];
+    V(&mutex);
+    reap(fd, pid);
+    spawn(cp->filename, &newfd, &pid);  /* a failed start shows on its next request */
+    P(&mutex);
+    cp->fds[i] = newfd;
+    cp->pids[i] = pid;
+    V(&mutex);
+    sbuf_add(&cp->idle, newfd);
+    return NULL;
+}
+
+/*
+ * respawn - replace the worker behind fd on a thread of its own; the
+ *     request goes on without waiting for the new one to start. The
+ *     caller took fd from the idle workers, so its slot is found
+ *     while fd is still open and no other worker can have it.
+ */
+static void respawn(cgiprog_t *cp, int fd)
+{
+    respawn_t *job = Malloc(sizeof(respawn_t));
+    pthread_t tid;
+    int i;
+
+    P(&mutex);
+    for (i = 0; cp->fds[i] != fd; i++)
+	;
+    V(&mutex);
+    job->cp = cp;
+    job->slot = i;
+    Pthread_create(&tid, NULL, respawn_thread, job);
+}
+
+/*
+ * find_prog - the pool of filename, started by the first request for
+ *     it. Requests that come while it starts get NULL and fork instead,
+ *     no one waits on a worker's startup holding the lock.
+ */
+static cgiprog_t *find_prog(char *filename)
+{
+    cgiprog_t *cp = NULL;
+    int fd, n;
+    pid_t pid;
+
+    P(&mutex);
+    for (int i = 0; i < nprogs; i++)
+	if (!strcmp(progs[i].filename, filename))
+	    cp = &progs[i];
+    if (cp != NULL || nprogs == CGI_MAXPROGS) {
+	if (cp && !cp->ready)
+	    cp = NULL;
+	V(&mutex);
+	return cp;
+    }
+    cp = &progs[nprogs++];
+    strcpy(cp->filename, filename);
+    cp->n = 0;
+    cp->ready = 0;
+    V(&mutex);
+
+    sbuf_init(&cp->idle, nworkers);
+    for (n = 0; n < nworkers; n++) {
+	if (spawn(filename, &fd, &pid) < 0) {
+	    /* Cannot run as a worker, keep running it with fork and exec */
+	    reap(fd, pid);
+	    break;
+	}
+	cp->fds[n] = fd;
+	cp->pids[n] = pid;
+	sbuf_add(&cp->idle, fd);
+    }
+
+    P(&mutex);
+    cp->n = n;
+    cp->ready = 1;
+    V(&mutex);
+    return cp;
+}
+
+/*
+ * cgipool_run - run filename with cgiargs on one of its persistent
+ *     workers, waiting only while all of them are busy. Return the
+ *     malloc'd output and its length in *len, or NULL if the program
+ *     has no pool or its worker failed; the caller then falls back to
+ *     fork and exec.
+ */
+char *cgipool_run(char *filename, char *cgiargs, size_t *len)
+{
+    cgiprog_t *cp;
+    char req[MAXBUF], *out;
+    int fd, n;
+
+    if (nworkers == 0 || !is_worker(filename) || (cp = find_prog(filename)) == NULL ||
+	cp->n == 0)
+	return NULL;
+    n = snprintf(req, MAXBUF, "QUERY_STRING=%s", cgiargs) + 1;
+    if (n > MAXBUF)
+	return NULL;
+
+    fd = sbuf_remove(&cp->idle);
+    if (fcgi_send(fd, req, n) < 0 || (out = fcgi_recv(fd, len)) == NULL) {
+	/* Died, or exec failed: the stream is lost with it */
+	respawn(cp, fd);
+	return NULL;
+    }
+    sbuf_add(&cp->idle, fd);
+    return out;
+}
@@ -0,0 +1,26 @@
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include "csapp.h"
+#include "sbuf.h"
+#include "fcgi.h"
+
+#define CGI_MAXPROGS   16   /* programs with a pool of their own */
+#define CGI_MAXWORKERS 64   /* workers per program at most */
+#define CGI_STARTUP    1000 /* ms a new worker has to say it is ready */
+#define CGI_WORKER_SUFFIX ".fcgi" /* programs started as persistent workers */
+
+/* The persistent workers running one CGI program */
+typedef struct {
+    char filename[MAXLINE];
+    int n;                       /* 0 if it cannot run as a worker */
+    int ready;                   /* its workers have been started */
+    int fds[CGI_MAXWORKERS];     /* tiny's end of each worker's socket */
+    pid_t pids[CGI_MAXWORKERS];
+    sbuf_t idle;                 /* fds of the workers free for a request */
+} cgiprog_t;
+
+void cgipool_init(int nworkers);
+char *cgipool_run(char *filename, char *cgiargs, size_t *len);
+
+#endif
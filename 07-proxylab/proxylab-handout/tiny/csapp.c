@@ -83,6 +83,21 @@ void Execve(const char *filename, char *const argv[], char *const envp[])
 	unix_error("Execve error");
 }
 
+/*
+ * close_from - close every descriptor from lowfd up, as a child does
+ *    before it runs a program that must not hold the parent's files,
+ *    with one call where the kernel has it
+ */
+void close_from(int lowfd)
+{
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, lowfd, ~0U, 0) == 0)
+	return;
+#endif
+    for (int fd = lowfd; fd < sysconf(_SC_OPEN_MAX); fd++)
+	close(fd);
+}
+
 /* $begin wait */
 pid_t Wait(int *status) 
 {
@@ -263,6 +278,71 @@ static size_t sio_strlen(char s[])
         ++i;
     return i;
 }
+
+/* sio_utoa - Write v in base b at s, return the number of digits */
+static size_t sio_utoa(unsigned long v, char s[], int b)
+{
+    char digits[64];
+    size_t i = 0, n = 0;
+
+    do {
+        digits[i++] = "0123456789abcdef"[v % b];
+    } while ((v /= b) > 0);
+    while (i > 0)
+        s[n++] = digits[--i];
+    return n;
+}
+
+/* sio_vprintf - Format fmt into a stack buffer and write it at once */
+static ssize_t sio_vprintf(const char *fmt, va_list ap)
+{
+    char buf[SIO_BUFSIZE], num[64], *s;
+    size_t n = 0, len;
+    int lng;
+    long v;
+
+    for (; *fmt && n < sizeof(buf); fmt++) {
+        if (*fmt != '%' || fmt[1] == '\0') {
+            buf[n++] = *fmt;
+            continue;
+        }
+        s = num;
+        lng = fmt[1] == 'l' && fmt[2] != '\0';
+        fmt += 1 + lng;
+        switch (*fmt) {
+        case 'd':
+            v = lng ? va_arg(ap, long) : va_arg(ap, int);
+            len = 0;
+            if (v < 0)
+                num[len++] = '-';
+            len += sio_utoa(v < 0 ? -(unsigned long)v : v, num + len, 10);
+            break;
+        case 'x':
+            len = sio_utoa(lng ? va_arg(ap, unsigned long) : va_arg(ap, unsigned), num, 16);
+            break;
+        case 'p':
+            num[0] = '0';
+            num[1] = 'x';
+            len = 2 + sio_utoa((unsigned long)va_arg(ap, void *), num + 2, 16);
+            break;
+        case 's':
+            if ((s = va_arg(ap, char *)) == NULL)
+                s = "(null)";
+            len = sio_strlen(s);
+            break;
+        case '%':
+            s = (char *)fmt;
+            len = 1;
+            break;
+        default: /* Not a conversion we know, copy it as is */
+            s = (char *)fmt - lng - 1;
+            len = lng + 2;
+        }
+        while (len-- > 0 && n < sizeof(buf))
+            buf[n++] = *s++;
+    }
+    return write(STDOUT_FILENO, buf, n);
+}
 /* $end sioprivate */
 
 /* Public Sio functions */
@@ -286,6 +366,21 @@ void sio_error(char s[]) /* Put error message and exit */
     sio_puts(s);
     _exit(1);                                      //line:csapp:sioexit
 }
+
+/*
+ * sio_printf - Put formatted output: %d %ld %s %x %lx %p and %%, with
+ *     a single write() of at most SIO_BUFSIZE bytes
+ */
+ssize_t sio_printf(const char *fmt, ...)
+{
+    va_list ap;
+    ssize_t n;
+
+    va_start(ap, fmt);
+    n = sio_vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
 /* $end siopublic */
 
 /*******************************
@@ -309,6 +404,18 @@ ssize_t Sio_puts(char s[])
     return n;
 }
 
+ssize_t Sio_printf(const char *fmt, ...)
+{
+    va_list ap;
+    ssize_t n;
+
+    va_start(ap, fmt);
+    if ((n = sio_vprintf(fmt, ap)) < 0)
+        sio_error("Sio_printf error");
+    va_end(ap);
+    return n;
+}
+
 void Sio_error(char s[])
 {
     sio_error(s);
@@ -742,6 +849,24 @@ void V(sem_t *sem)
  * The Rio package - Robust I/O functions
  ****************************************/
 
+/*
+ * rio_wait - wait for fd to be ready for events, as a descriptor left
+ *    nonblocking has to before it is read or written again
+ */
+static int rio_wait(int fd, short events)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while (poll(&pfd, 1, -1) < 0)
+	if (errno != EINTR)
+	    return -1;
+    return 0;
+}
+
+#define rio_wouldblock(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -756,6 +881,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* Interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
+	    else if (rio_wouldblock(errno) && rio_wait(fd, POLLIN) == 0)
+		nread = 0;      /* Nonblocking fd, wait for input */
 	    else
 		return -1;      /* errno set by read() */ 
 	} 
@@ -782,6 +909,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if (rio_wouldblock(errno) && rio_wait(fd, POLLOUT) == 0)
+		nwritten = 0;    /* Nonblocking fd, wait for room */
 	    else
 		return -1;       /* errno set by write() */
 	}
@@ -792,6 +921,248 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+#ifndef UIO_MAXIOV
+#define UIO_MAXIOV 1024
+#endif
+
+/*
+ * rio_iovwrite - one writev() of iov from byte done on, with any part of
+ *    the first buffer already written left out. iov is left as it was.
+ *    Returns what writev() does, or 0 once there is nothing left.
+ */
+static ssize_t rio_iovwrite(int fd, struct iovec *iov, int iovcnt, size_t done)
+{
+    struct iovec head;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < iovcnt && done >= iov[i].iov_len; i++)
+	done -= iov[i].iov_len;
+    if (i == iovcnt)
+	return 0;
+    head = iov[i];
+    iov[i].iov_base = (char *)iov[i].iov_base + done;
+    iov[i].iov_len -= done;
+    n = writev(fd, iov + i, iovcnt - i < UIO_MAXIOV ? iovcnt - i : UIO_MAXIOV);
+    iov[i] = head;
+    return n;
+}
+
+/*
+ * rio_iovlen - the bytes in iovcnt buffers
+ */
+static size_t rio_iovlen(struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+    return len;
+}
+
+/*
+ * rio_writevn - Robustly write all the bytes of iovcnt buffers with as
+ *    few writev() calls as the kernel allows. iov is left as it was.
+ */
+/* $begin rio_writevn */
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t n = rio_iovlen(iov, iovcnt), done = 0;
+    ssize_t nwritten;
+
+    while (done < n) {
+	if ((nwritten = rio_iovwrite(fd, iov, iovcnt, done)) <= 0) {
+	    if (errno == EINTR) /* Interrupted by sig handler return */
+		nwritten = 0;   /* and call writev() again */
+	    else if (rio_wouldblock(errno) && rio_wait(fd, POLLOUT) == 0)
+		nwritten = 0;   /* Nonblocking fd, wait for room */
+	    else
+		return -1; /* errno set by writev() */
+	}
+	done += nwritten;
+    }
+    return n;
+}
+/* $end rio_writevn */
+
+/*
+ * rio_trywritev - Write iovcnt buffers to rp's descriptor for an event
+ *    loop: where a nonblocking descriptor has no room it returns -1 with
+ *    errno EAGAIN, keeping how far it got in rp, and the caller tries
+ *    again with the same buffers once the descriptor is writable.
+ *    Returns the bytes in iov once they are all written.
+ */
+ssize_t rio_trywritev(rio_t *rp, struct iovec *iov, int iovcnt)
+{
+    size_t n = rio_iovlen(iov, iovcnt);
+    ssize_t nwritten;
+
+    while (rp->rio_wcnt < n) {
+	if ((nwritten = rio_iovwrite(rp->rio_fd, iov, iovcnt, rp->rio_wcnt)) < 0) {
+	    if (errno == EINTR) /* Interrupted by sig handler return */
+		continue;
+	    return -1; /* errno set by writev(), EAGAIN to come back */
+	}
+	rp->rio_wcnt += nwritten;
+    }
+    rp->rio_wcnt = 0;
+    return n;
+}
+
+/*
+ * rio_writeinitb - Associate a descriptor with a write buffer
+ */
+void rio_writeinitb(rio_wbuf_t *wp, int fd)
+{
+    wp->rio_fd = fd;
+    wp->rio_cnt = 0;
+}
+
+/*
+ * rio_writenb - Robustly write n bytes (buffered). They are held in the
+ *    internal buffer until it cannot take them, then written out along
+ *    with it in a single writev(). Nothing reaches fd before that or
+ *    rio_flushb().
+ */
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n)
+{
+    struct iovec iov[2];
+
+    if (n <= RIO_BUFSIZE - wp->rio_cnt) {
+	memcpy(wp->rio_buf + wp->rio_cnt, usrbuf, n);
+	wp->rio_cnt += n;
+	return n;
+    }
+    iov[0].iov_base = wp->rio_buf;
+    iov[0].iov_len = wp->rio_cnt;
+    iov[1].iov_base = usrbuf;
+    iov[1].iov_len = n;
+    wp->rio_cnt = 0;
+    if (rio_writevn(wp->rio_fd, iov, 2) < 0)
+	return -1;
+    return n;
+}
+
+/*
+ * rio_flushb - Write out whatever the internal buffer holds, return 0
+ *    or -1 on error
+ */
+ssize_t rio_flushb(rio_wbuf_t *wp)
+{
+    size_t cnt = wp->rio_cnt;
+
+    wp->rio_cnt = 0;
+    return rio_writen(wp->rio_fd, wp->rio_buf, cnt) < 0 ? -1 : 0;
+}
+
+
+/*
+ * Buffers of the default size are pooled, so that an idle connection can
+ * give its buffer back and take one again on its next request. Each
+ * thread keeps a few in its own pool and only takes the lock of the
+ * shared one when its pool runs empty or full. Other sizes go straight
+ * to and from malloc.
+ */
+static char *rio_pool[RIO_POOLMAX];
+static int rio_npool = 0;
+static pthread_mutex_t rio_poollock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char *bufs[RIO_TPOOLMAX];
+    int n;
+} rio_tpool_t;
+static __thread rio_tpool_t rio_tpool;
+static pthread_key_t rio_tpoolkey;
+static pthread_once_t rio_tpoolonce = PTHREAD_ONCE_INIT;
+
+/* rio_tpoolexit - move an exiting thread's buffers to the shared pool */
+static void rio_tpoolexit(void *arg)
+{
+    rio_tpool_t *tp = arg;
+
+    pthread_mutex_lock(&rio_poollock);
+    while (tp->n > 0 && rio_npool < RIO_POOLMAX)
+	rio_pool[rio_npool++] = tp->bufs[--tp->n];
+    pthread_mutex_unlock(&rio_poollock);
+    while (tp->n > 0)
+	free(tp->bufs[--tp->n]);
+}
+
+static void rio_tpoolkeyinit(void)
+{
+    pthread_key_create(&rio_tpoolkey, rio_tpoolexit);
+}
+
+/* rio_getbuf - give rp a buffer of rio_size bytes, -1 if out of memory */
+static int rio_getbuf(rio_t *rp)
+{
+    rp->rio_buf = NULL;
+    if (rp->rio_size == RIO_BUFSIZE) {
+	if (rio_tpool.n > 0)
+	    rp->rio_buf = rio_tpool.bufs[--rio_tpool.n];
+	else {
+	    pthread_mutex_lock(&rio_poollock);
+	    if (rio_npool > 0)
+		rp->rio_buf = rio_pool[--rio_npool];
+	    pthread_mutex_unlock(&rio_poollock);
+	}
+    }
+    if (rp->rio_buf == NULL && (rp->rio_buf = malloc(rp->rio_size)) == NULL)
+	return -1;
+    rp->rio_bufptr = rp->rio_buf;
+    return 0;
+}
+
+/* rio_putbuf - hand back a buffer of size bytes */
+static void rio_putbuf(char *buf, size_t size)
+{
+    if (size == RIO_BUFSIZE) {
+	if (rio_tpool.n < RIO_TPOOLMAX) {
+	    /* the first buffer kept arms the exit hook of this thread */
+	    if (rio_tpool.n == 0) {
+		pthread_once(&rio_tpoolonce, rio_tpoolkeyinit);
+		pthread_setspecific(rio_tpoolkey, &rio_tpool);
+	    }
+	    rio_tpool.bufs[rio_tpool.n++] = buf;
+	    return;
+	}
+	pthread_mutex_lock(&rio_poollock);
+	if (rio_npool < RIO_POOLMAX) {
+	    rio_pool[rio_npool++] = buf;
+	    buf = NULL;
+	}
+	pthread_mutex_unlock(&rio_poollock);
+    }
+    free(buf);
+}
+
+/* 
+ * rio_fill - refill the internal buffer via a call to read() if it is
+ *    empty, taking a buffer first if it has none. Returns the number of
+ *    unread bytes, 0 on EOF or -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_buf == NULL && rio_getbuf(rp) < 0)
+	return -1;
+    while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+	if ((n = read(rp->rio_fd, rp->rio_buf, rp->rio_size)) < 0) {
+	    if (errno == EINTR) /* Interrupted by sig handler return */
+		continue;
+	    if (!rio_wouldblock(errno) || rio_wait(rp->rio_fd, POLLIN) < 0)
+		return -1;
+	}
+	else if (n == 0) /* EOF */
+	    return 0;
+	else {
+	    rp->rio_cnt = n;
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+	}
+    }
+    return rp->rio_cnt;
+}
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -806,18 +1177,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -836,12 +1197,45 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 /* $begin rio_readinitb */
 void rio_readinitb(rio_t *rp, int fd) 
 {
-    rp->rio_fd = fd;  
-    rp->rio_cnt = 0;  
-    rp->rio_bufptr = rp->rio_buf;
+    rio_readinitb_size(rp, fd, RIO_BUFSIZE);
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_readinitb_size - Associate a descriptor with a read buffer of size
+ *    bytes. The buffer itself is only taken on the first read.
+ */
+void rio_readinitb_size(rio_t *rp, int fd, size_t size)
+{
+    rp->rio_fd = fd;
+    rp->rio_cnt = 0;
+    rp->rio_buf = rp->rio_bufptr = NULL;
+    rp->rio_size = size;
+    rp->rio_wcnt = 0;
+}
+
+/*
+ * rio_release - Give the buffer back while it holds no unread bytes, as
+ *    an idle connection should; the next read takes one again
+ */
+void rio_release(rio_t *rp)
+{
+    if (rp->rio_cnt == 0 && rp->rio_buf != NULL) {
+	rio_putbuf(rp->rio_buf, rp->rio_size);
+	rp->rio_buf = rp->rio_bufptr = NULL;
+    }
+}
+
+/*
+ * rio_freeb - Drop any unread bytes and give the buffer back, once the
+ *    descriptor is done with
+ */
+void rio_freeb(rio_t *rp)
+{
+    rp->rio_cnt = 0;
+    rio_release(rp);
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -865,34 +1259,159 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The newline is
+ *    found with memchr() over the internal buffer and the line copied
+ *    out in one go, rather than one rio_read() per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
+    while (n + 1 < maxlen && nl == NULL) {
+	if ((rc = rio_fill(rp)) < 0)
 	    return -1;	  /* Error */
+	else if (rc == 0)
+	    break;        /* EOF */
+
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
-    return n-1;
+    if (maxlen > 0)
+	bufp[n] = 0;
+    return n;     /* 0 on EOF with no data read */
 }
 /* $end rio_readlineb */
 
+/* 
+ * rio_more - read more of the descriptor in after the unread bytes,
+ *    first moving them to the front of the internal buffer if they
+ *    reach its end, or growing it up to RIO_MAXBUFSIZE if it is full.
+ *    Unless wait is set, a nonblocking descriptor with nothing to read
+ *    fails with EAGAIN. Returns the bytes read, 0 on EOF or if the
+ *    buffer cannot grow, -1 on error.
+ */
+static ssize_t rio_more(rio_t *rp, int wait)
+{
+    ssize_t n;
+    size_t size;
+    char *buf;
+
+    if (rp->rio_buf == NULL && rio_getbuf(rp) < 0)
+	return -1;
+    if (rp->rio_cnt == rp->rio_size) {
+	/* Full, grow it for a line that does not fit */
+	if (rp->rio_size >= RIO_MAXBUFSIZE)
+	    return 0;
+	size = 2 * rp->rio_size < RIO_MAXBUFSIZE ? 2 * rp->rio_size : RIO_MAXBUFSIZE;
+	if ((buf = malloc(size)) == NULL)
+	    return -1;
+	memcpy(buf, rp->rio_bufptr, rp->rio_cnt);
+	rio_putbuf(rp->rio_buf, rp->rio_size);
+	rp->rio_buf = rp->rio_bufptr = buf;
+	rp->rio_size = size;
+    }
+    else if (rp->rio_cnt == 0)
+	rp->rio_bufptr = rp->rio_buf;
+    else if (rp->rio_bufptr + rp->rio_cnt == rp->rio_buf + rp->rio_size) {
+	/* Compact, only ever for data straddling the end */
+	memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+    }
+    while ((n = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+		     rp->rio_buf + rp->rio_size - rp->rio_bufptr - rp->rio_cnt)) < 0) {
+	if (errno == EINTR) /* Interrupted by sig handler return */
+	    continue;
+	if (!wait || !rio_wouldblock(errno) || rio_wait(rp->rio_fd, POLLIN) < 0)
+	    return -1;
+    }
+    rp->rio_cnt += n;
+    return n;
+}
+
+/* 
+ * rio_peekline - Point *linep at the next text line, newline included,
+ *    inside the internal buffer instead of copying it out. The line is
+ *    not consumed, see rio_consume(), and stays valid (and writable)
+ *    until the next call on rp. A line longer than RIO_MAXBUFSIZE comes
+ *    back cut short, without its newline. Returns the length, 0 on EOF
+ *    or -1 on error.
+ */
+ssize_t rio_peekline(rio_t *rp, char **linep)
+{
+    size_t scanned = 0;
+    char *nl;
+    ssize_t rc;
+
+    while ((nl = memchr(rp->rio_bufptr + scanned, '\n',
+			rp->rio_cnt - scanned)) == NULL) {
+	scanned = rp->rio_cnt;
+	if ((rc = rio_more(rp, 1)) < 0)
+	    return -1; /* Error */
+	else if (rc == 0)
+	    break; /* EOF or buffer full */
+    }
+    *linep = rp->rio_bufptr;
+    return nl ? nl - rp->rio_bufptr + 1 : rp->rio_cnt;
+}
+
+/* 
+ * rio_peekn - Point *p at the next n bytes (at most rio_size) inside
+ *    the internal buffer, on the same terms as rio_peekline(). Returns
+ *    how many are there, short only on EOF, or -1 on error.
+ */
+ssize_t rio_peekn(rio_t *rp, char **p, size_t n)
+{
+    ssize_t rc;
+
+    if (n > rp->rio_size)
+	n = rp->rio_size;
+    while (rp->rio_cnt < n) {
+	if ((rc = rio_more(rp, 1)) < 0)
+	    return -1; /* Error */
+	else if (rc == 0)
+	    break; /* EOF */
+    }
+    *p = rp->rio_bufptr;
+    return rp->rio_cnt < n ? rp->rio_cnt : n;
+}
+
+/* 
+ * rio_consume - Drop n bytes already looked at with rio_peekline() or
+ *    rio_peekn() from the internal buffer
+ */
+void rio_consume(rio_t *rp, size_t n)
+{
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
+/*
+ * rio_tryreadb - Read what the descriptor has into the internal buffer,
+ *    for an event loop: a nonblocking descriptor with nothing to read
+ *    returns -1 with errno EAGAIN, and whatever was read before stays
+ *    in the buffer for rio_peekline() and the rest to find. Returns
+ *    the bytes read, 0 on EOF or -1 with errno ENOBUFS once the buffer
+ *    is full and cannot grow.
+ */
+ssize_t rio_tryreadb(rio_t *rp)
+{
+    if (rp->rio_cnt == rp->rio_size && rp->rio_size >= RIO_MAXBUFSIZE) {
+	errno = ENOBUFS;
+	return -1;
+    }
+    return rio_more(rp, 0);
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -911,6 +1430,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writevn(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writevn(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writevn error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -934,56 +1459,205 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_peekline(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_peekline(rp, linep)) < 0)
+	unix_error("Rio_peekline error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
+static sockopts_t sockopts_default; /* All zero, the kernel's defaults */
+
+/*
+ * sockopts_set - Apply the options both ends have in common to fd. They
+ *     only tune the socket, so like SO_REUSEADDR a failure is ignored.
+ */
+static void sockopts_set(int fd, sockopts_t *opts) {
+    if (opts->nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay, sizeof(int));
+    if (opts->rcvbuf)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(int));
+    if (opts->sndbuf)
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, sizeof(int));
+}
+
+/*
+ * sockopts_parse - Fill in opts from a comma separated list such as
+ *     "nodelay,rcvbuf=262144,backlog=4096", a name alone sets it to 1.
+ *     Returns -1 on an unknown name or a bad value.
+ */
+int sockopts_parse(sockopts_t *opts, char *spec) {
+    static struct {
+        char *name;
+        size_t offset;
+    } names[] = {
+        {"nodelay", offsetof(sockopts_t, nodelay)},
+        {"rcvbuf", offsetof(sockopts_t, rcvbuf)},
+        {"sndbuf", offsetof(sockopts_t, sndbuf)},
+        {"fastopen", offsetof(sockopts_t, fastopen)},
+        {"defer_accept", offsetof(sockopts_t, defer_accept)},
+        {"backlog", offsetof(sockopts_t, backlog)},
+        {"reuseport", offsetof(sockopts_t, reuseport)},
+    };
+    size_t len, namelen, i, n = sizeof(names) / sizeof(names[0]);
+    char *end;
+    long val;
+
+    for (; *spec; spec += len + (spec[len] == ',')) {
+        len = strcspn(spec, ",");
+        namelen = strcspn(spec, "=,");
+        for (i = 0; i < n; i++)
+            if (strlen(names[i].name) == namelen && !strncmp(spec, names[i].name, namelen))
+                break;
+        if (i == n)
+            return -1;
+        val = 1;
+        if (namelen < len) {
+            val = strtol(spec + namelen + 1, &end, 10);
+            if (end != spec + len || end == spec + namelen + 1 || val < 0 || val > INT_MAX)
+                return -1;
+        }
+        *(int *)((char *)opts + names[i].offset) = val;
+    }
+    return 0;
+}
+
+/*
+ * connect_start - Start a nonblocking connect to p. Returns the socket,
+ *     with *done set if it connected at once, or -1 if it failed.
+ */
+static int connect_start(struct addrinfo *p, sockopts_t *opts, int *done) {
+    int fd;
+
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+        return -1;
+    sockopts_set(fd, opts);
+#ifdef TCP_FASTOPEN_CONNECT
+    /* The SYN carries the first write, once the server gave us a cookie */
+    if (opts->fastopen)
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opts->fastopen, sizeof(int));
+#endif
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    *done = connect(fd, p->ai_addr, p->ai_addrlen) == 0;
+    if (!*done && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
  *     function is reentrant and protocol-independent.
  *
+ *     The addresses are tried the happy eyeballs way (RFC 8305): the
+ *     families take turns, a new connect starts every CONNECT_DELAY ms
+ *     or as soon as one fails, without giving up on those under way,
+ *     and the first to succeed wins. A dead address costs CONNECT_DELAY
+ *     rather than a whole TCP timeout.
+ *
  *     On error, returns: 
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
-    int clientfd, rc;
+    return open_clientfd_opts(hostname, port, NULL);
+}
+/* $end open_clientfd */
+
+/*
+ * open_clientfd_opts - open_clientfd with the socket options in opts,
+ *     NULL for none. With fastopen a connect that holds a cookie
+ *     completes at once, so the first address wins without a race.
+ */
+int open_clientfd_opts(char *hostname, char *port, sockopts_t *opts) {
+    int clientfd = -1, rc, done, err;
+    int nfirst = 0, nother = 0, naddrs = 0, next = 0, active = 0;
     struct addrinfo hints, *listp, *p;
+    struct addrinfo *first[CONNECT_MAXADDRS], *other[CONNECT_MAXADDRS], *addrs[CONNECT_MAXADDRS];
+    struct pollfd pfds[CONNECT_MAXADDRS];
+    socklen_t len;
+
+    if (opts == NULL)
+        opts = &sockopts_default;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
-    hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
-    hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
+    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
+    hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
     if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
-  
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
 
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
+    /* Interleave the address families, the first one listed first */
+    for (p = listp; p; p = p->ai_next)
+        if (p->ai_family == listp->ai_family) {
+            if (nfirst < CONNECT_MAXADDRS)
+                first[nfirst++] = p;
+        }
+        else if (nother < CONNECT_MAXADDRS)
+            other[nother++] = p;
+    for (int i = 0; i < nfirst || i < nother; i++) {
+        if (i < nfirst && naddrs < CONNECT_MAXADDRS)
+            addrs[naddrs++] = first[i];
+        if (i < nother && naddrs < CONNECT_MAXADDRS)
+            addrs[naddrs++] = other[i];
+    }
+
+    /* Race the connects until one of them gets through */
+    while (clientfd < 0 && (next < naddrs || active > 0)) {
+        if (next < naddrs) { /* Start the next attempt */
+            if ((rc = connect_start(addrs[next++], opts, &done)) < 0)
+                continue; /* Failed at once, try the next */
+            if (done) {
+                clientfd = rc;
+                break;
+            }
+            pfds[active].fd = rc;
+            pfds[active++].events = POLLOUT;
+        }
+
+        /* Wait for an attempt to finish, or until the next is due */
+        if ((rc = poll(pfds, active, next < naddrs ? CONNECT_DELAY : -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < active && clientfd < 0; i++) {
+            if (pfds[i].revents == 0)
+                continue;
+            len = sizeof(err);
+            if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                clientfd = pfds[i].fd;
+                pfds[i--] = pfds[--active];
+            }
+            else
+            { /* Connect failed, the next attempt need not wait */
+                close(pfds[i].fd);
+                pfds[i--] = pfds[--active];
+                errno = err;
+            }
+        }
+    }
 
     /* Clean up */
+    while (active > 0)
+        close(pfds[--active].fd);
     freeaddrinfo(listp);
-    if (!p) /* All connects failed */
+    if (clientfd < 0) /* All connects failed */
         return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
+    return clientfd; /* The first connect to succeed */
 }
-/* $end open_clientfd */
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
@@ -995,10 +1669,24 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opts(port, NULL);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_opts - open_listenfd with the socket options in opts,
+ *     NULL for none. Accepted connections inherit nodelay and the
+ *     buffer sizes from the listener.
+ */
+int open_listenfd_opts(char *port, sockopts_t *opts) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
 
+    if (opts == NULL)
+        opts = &sockopts_default;
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
@@ -1018,6 +1706,13 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (opts->reuseport) /* Let other listeners bind the same port */
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        sockopts_set(listenfd, opts);
+        if (opts->fastopen)
+            setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(int));
+        if (opts->defer_accept)
+            setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept, sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1035,13 +1730,12 @@ int open_listenfd(char *port)
         return -1;
 
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, opts->backlog ? opts->backlog : LISTENQ) < 0) {
         close(listenfd);
 	return -1;
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1064,6 +1758,24 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_clientfd_opts(char *hostname, char *port, sockopts_t *opts) 
+{
+    int rc;
+
+    if ((rc = open_clientfd_opts(hostname, port, opts)) < 0) 
+	unix_error("Open_clientfd_opts error");
+    return rc;
+}
+
+int Open_listenfd_opts(char *port, sockopts_t *opts) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_opts(port, opts)) < 0)
+	unix_error("Open_listenfd_opts error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -7,6 +7,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
@@ -17,9 +19,12 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -27,6 +32,7 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -42,15 +48,39 @@ typedef struct sockaddr SA;
 
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE 8192             /* Default, pooled buffer size */
+#define RIO_MAXBUFSIZE (64 * 1024)   /* Largest a buffer grows for a line */
+#define RIO_POOLMAX 1024             /* Idle buffers kept in the shared pool */
+#define RIO_TPOOLMAX 8               /* and in each thread's own */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_buf;             /* Internal buffer, NULL while released */
+    size_t rio_size;           /* Its size */
+    size_t rio_wcnt;           /* Bytes of a rio_trywritev() already sent */
 } rio_t;
 /* $end rio_t */
 
+/* Persistent state for buffered Rio writes */
+typedef struct {
+    int rio_fd;                /* Descriptor for this internal buf */
+    size_t rio_cnt;            /* Bytes waiting in internal buf */
+    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+} rio_wbuf_t;
+
+/* Socket options for open_clientfd_opts and open_listenfd_opts, 0 leaves
+   the kernel's default. The last four only apply to listeners. */
+typedef struct {
+    int nodelay;      /* TCP_NODELAY: small writes go out at once */
+    int rcvbuf;       /* SO_RCVBUF in bytes */
+    int sndbuf;       /* SO_SNDBUF in bytes */
+    int fastopen;     /* TCP_FASTOPEN: data in the SYN, a listener's queue length */
+    int defer_accept; /* TCP_DEFER_ACCEPT: seconds to wait for the first data */
+    int backlog;      /* Second argument to listen(), LISTENQ if 0 */
+    int reuseport;    /* SO_REUSEPORT: listeners share the port */
+} sockopts_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -59,6 +89,9 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#define SIO_BUFSIZE 1024       /* Longest sio_printf message */
+#define CONNECT_DELAY 250      /* ms between staggered connects (RFC 8305) */
+#define CONNECT_MAXADDRS 16    /* Addresses open_clientfd tries at most */
 
 /* Our own error-handling functions */
 void unix_error(char *msg);
@@ -70,6 +103,7 @@ void app_error(char *msg);
 /* Process control wrappers */
 pid_t Fork(void);
 void Execve(const char *filename, char *const argv[], char *const envp[]);
+void close_from(int lowfd);
 pid_t Wait(int *status);
 pid_t Waitpid(pid_t pid, int *iptr, int options);
 void Kill(pid_t pid, int signum);
@@ -93,11 +127,13 @@ int Sigsuspend(const sigset_t *set);
 /* Sio (Signal-safe I/O) routines */
 ssize_t sio_puts(char s[]);
 ssize_t sio_putl(long v);
+ssize_t sio_printf(const char *fmt, ...);
 void sio_error(char s[]);
 
 /* Sio wrappers */
 ssize_t Sio_puts(char s[]);
 ssize_t Sio_putl(long v);
+ssize_t Sio_printf(const char *fmt, ...);
 void Sio_error(char s[]);
 
 /* Unix I/O wrappers */
@@ -175,24 +211,43 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writevn(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
+void rio_readinitb_size(rio_t *rp, int fd, size_t size);
+void rio_release(rio_t *rp);
+void rio_freeb(rio_t *rp);
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t rio_peekline(rio_t *rp, char **linep);
+ssize_t rio_peekn(rio_t *rp, char **p, size_t n);
+void rio_consume(rio_t *rp, size_t n);
+ssize_t rio_tryreadb(rio_t *rp);
+ssize_t rio_trywritev(rio_t *rp, struct iovec *iov, int iovcnt);
+void rio_writeinitb(rio_wbuf_t *wp, int fd);
+ssize_t rio_writenb(rio_wbuf_t *wp, void *usrbuf, size_t n);
+ssize_t rio_flushb(rio_wbuf_t *wp);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writevn(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_peekline(rio_t *rp, char **linep);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_clientfd_opts(char *hostname, char *port, sockopts_t *opts);
+int open_listenfd_opts(char *port, sockopts_t *opts);
+int sockopts_parse(sockopts_t *opts, char *spec);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_clientfd_opts(char *hostname, char *port, sockopts_t *opts);
+int Open_listenfd_opts(char *port, sockopts_t *opts);
 
 
 #endif /* __CSAPP_H__ */
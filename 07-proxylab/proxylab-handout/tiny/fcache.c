@@ -0,0 +1,120 @@
+#include "fcache.h"
+
+static unsigned long hash(char *s){
+    unsigned long h = 5381;
+
+    while(*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+void fcache_init(fcache_t *fc, int max, int interval, fc_fill_t *fill){
+    fc->nbuckets = 1;
+    while(fc->nbuckets < 2 * max) fc->nbuckets <<= 1;
+    fc->buckets = Calloc(fc->nbuckets, sizeof(fentry_t *));
+    fc->head = fc->tail = NULL;
+    fc->count = 0;
+    fc->max = max;
+    fc->interval = interval;
+    fc->fill = fill;
+    Sem_init(&fc->mutex, 0, 1);
+}
+
+static void free_entry(fentry_t *fe){
+    if(fe->fd >= 0) close(fe->fd);
+    Free(fe->filename);
+    Free(fe);
+}
+
+static void lru_unlink(fcache_t *fc, fentry_t *fe){
+    if(fe->prev) fe->prev->next = fe->next;
+    else fc->head = fe->next;
+    if(fe->next) fe->next->prev = fe->prev;
+    else fc->tail = fe->prev;
+}
+
+static void lru_push(fcache_t *fc, fentry_t *fe){
+    fe->prev = NULL;
+    fe->next = fc->head;
+    if(fc->head) fc->head->prev = fe;
+    else fc->tail = fe;
+    fc->head = fe;
+}
+
+/* Drop fe from the cache, it is freed once the last request puts it back. */
+static void remove_entry(fcache_t *fc, fentry_t *fe){
+    fentry_t **pp = &fc->buckets[hash(fe->filename) & (fc->nbuckets - 1)];
+
+    while(*pp != fe) pp = &(*pp)->hnext;
+    *pp = fe->hnext;
+    lru_unlink(fc, fe);
+    fc->count--;
+    fe->cached = 0;
+    if(fe->refcnt == 0) free_entry(fe);
+}
+
+void fcache_destory(fcache_t *fc){
+    while(fc->head) remove_entry(fc, fc->head);
+    Free(fc->buckets);
+}
+
+/* Look up filename, opening it on a miss. Return a referenced entry that
+ * must be given back with fcache_put, or NULL if the file cannot be stat'ed. */
+fentry_t *fcache_get(fcache_t *fc, char *filename){
+    unsigned long b = hash(filename) & (fc->nbuckets - 1);
+    time_t now = time(NULL);
+    struct stat st;
+    fentry_t *fe;
+
+    P(&fc->mutex);
+    for(fe = fc->buckets[b]; fe; fe = fe->hnext){
+        if(!strcmp(fe->filename, filename)) break;
+    }
+    // revalidate, the file may have been replaced or changed in place.
+    if(fe && now - fe->checked >= fc->interval){
+        if(stat(filename, &st) < 0 || st.st_ino != fe->st.st_ino ||
+           st.st_dev != fe->st.st_dev || st.st_size != fe->st.st_size ||
+           st.st_mtim.tv_sec != fe->st.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != fe->st.st_mtim.tv_nsec || st.st_mode != fe->st.st_mode){
+            remove_entry(fc, fe);
+            fe = NULL;
+        }
+        else fe->checked = now;
+    }
+    if(fe){
+        lru_unlink(fc, fe);
+        lru_push(fc, fe);
+        fe->refcnt++;
+        V(&fc->mutex);
+        return fe;
+    }
+
+    if(stat(filename, &st) < 0){
+        V(&fc->mutex);
+        return NULL;
+    }
+    fe = Malloc(sizeof(fentry_t));
+    fe->filename = Malloc(strlen(filename) + 1);
+    strcpy(fe->filename, filename);
+    fe->st = st;
+    fe->fd = (S_ISREG(st.st_mode) && (S_IRUSR & st.st_mode)) ? open(filename, O_RDONLY, 0) : -1;
+    fe->checked = now;
+    fe->gz_missing = 0;
+    fe->hdrlen = 0;
+    fe->refcnt = 1;
+    fe->cached = 1;
+    if(fe->fd >= 0) fc->fill(fe);
+
+    if(fc->count == fc->max) remove_entry(fc, fc->tail);
+    fe->hnext = fc->buckets[b];
+    fc->buckets[b] = fe;
+    lru_push(fc, fe);
+    fc->count++;
+    V(&fc->mutex);
+    return fe;
+}
+
+void fcache_put(fcache_t *fc, fentry_t *fe){
+    P(&fc->mutex);
+    if(--fe->refcnt == 0 && !fe->cached) free_entry(fe);
+    V(&fc->mutex);
+}
@@ -0,0 +1,42 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+#define FC_HDRSIZE 256
+
+/* An open file with its metadata and prebuilt response headers */
+typedef struct fentry {
+    char *filename;
+    int fd;                     /* -1 if the file could not be opened */
+    struct stat st;
+    time_t checked;             /* last time st was compared with the file */
+    time_t gz_missing;          /* last time filename.gz was found missing, 0 if not */
+    char hdr[FC_HDRSIZE];
+    int hdrlen;
+    int refcnt;                 /* requests still sending from fd */
+    int cached;                 /* still reachable from the cache */
+    struct fentry *hnext;       /* hash chain */
+    struct fentry *prev, *next; /* LRU list, most recently used first */
+} fentry_t;
+
+typedef void fc_fill_t(fentry_t *fe);
+
+/* LRU cache of open files, revalidated with stat() at most every interval seconds */
+typedef struct {
+    fentry_t **buckets;
+    int nbuckets;
+    fentry_t *head, *tail;
+    int count;
+    int max;
+    int interval;
+    fc_fill_t *fill;            /* computes hdr for a new entry */
+    sem_t mutex;
+} fcache_t;
+
+void fcache_init(fcache_t *fc, int max, int interval, fc_fill_t *fill);
+void fcache_destory(fcache_t *fc);
+fentry_t *fcache_get(fcache_t *fc, char *filename);
+void fcache_put(fcache_t *fc, fentry_t *fe);
+
+#endif
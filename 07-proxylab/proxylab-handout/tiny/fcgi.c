@@ -0,0 +1,119 @@
+#include "fcgi.h"
+
+/* Only plain syscalls here, CGI programs link this without csapp.o. */
+
+/*
+ * write_all - write all len bytes of buf, return -1 on error
+ */
+static int write_all(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = write(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+ * read_all - read exactly len bytes into buf, return -1 on error or EOF
+ */
+static int read_all(int fd, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = read(fd, buf, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0)
+	    return -1;       /* EOF in the middle of a frame */
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+ * fcgi_send - send len bytes of buf as one frame
+ */
+int fcgi_send(int fd, char *buf, size_t len)
+{
+    uint32_t hdr = len;
+
+    if (write_all(fd, (char *)&hdr, sizeof(hdr)) < 0)
+	return -1;
+    return write_all(fd, buf, len);
+}
+
+/*
+ * fcgi_recv - read one frame into a malloc'd, NUL terminated buffer.
+ *     Return NULL on EOF, error or a frame over FCGI_MAXFRAME.
+ */
+char *fcgi_recv(int fd, size_t *len)
+{
+    uint32_t hdr;
+    char *buf;
+
+    if (read_all(fd, (char *)&hdr, sizeof(hdr)) < 0 || hdr > FCGI_MAXFRAME)
+	return NULL;
+    if ((buf = malloc(hdr + 1)) == NULL)
+	return NULL;
+    if (read_all(fd, buf, hdr) < 0) {
+	free(buf);
+	return NULL;
+    }
+    buf[hdr] = '\0';
+    *len = hdr;
+    return buf;
+}
+
+/*
+ * fcgi_worker - whether the program was started as a persistent
+ *     worker, telling tiny it is ready if so
+ */
+int fcgi_worker(void)
+{
+    if (getenv(FCGI_ENV) == NULL)
+	return 0;
+    return fcgi_send(STDIN_FILENO, "", 0) == 0;
+}
+
+/*
+ * fcgi_accept - wait for the next request and put its variables in
+ *     the environment. Return -1 once tiny has closed the connection.
+ */
+int fcgi_accept(void)
+{
+    char *buf, *p;
+    size_t len;
+
+    if ((buf = fcgi_recv(STDIN_FILENO, &len)) == NULL)
+	return -1;
+    for (p = buf; p < buf + len; p += strlen(p) + 1) {
+	char *eq = strchr(p, '=');
+
+	if (eq == NULL)
+	    continue;
+	*eq = '\0';
+	setenv(p, eq + 1, 1);
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * fcgi_reply - send the output of a request back to tiny
+ */
+int fcgi_reply(char *buf, size_t len)
+{
+    return fcgi_send(STDIN_FILENO, buf, len);
+}
@@ -0,0 +1,24 @@
+#ifndef __FCGI_H__
+#define __FCGI_H__
+
+#include "csapp.h"
+
+/*
+ * A FastCGI-like protocol between tiny and its persistent CGI workers.
+ * Every message is a frame: a 4-byte length in host order, then that
+ * many bytes. A request carries the CGI variables as "NAME=value\0"
+ * pairs, the reply carries what the program would have written to
+ * stdout. A worker talks to tiny over the Unix socket on its stdin.
+ */
+#define FCGI_ENV      "TINY_FCGI"      /* set in a worker's environment */
+#define FCGI_MAXFRAME (1 << 24)        /* larger frames are refused */
+
+int fcgi_send(int fd, char *buf, size_t len);
+char *fcgi_recv(int fd, size_t *len);
+
+/* The worker side */
+int fcgi_worker(void);
+int fcgi_accept(void);
+int fcgi_reply(char *buf, size_t len);
+
+#endif
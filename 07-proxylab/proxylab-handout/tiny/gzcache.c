@@ -0,0 +1,169 @@
+#include <zlib.h>
+#include "gzcache.h"
+
+#define GZ_NBUCKETS 256
+
+static unsigned long hash(char *s){
+    unsigned long h = 5381;
+
+    while(*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+void gzcache_init(gzcache_t *gc, size_t max, gz_hdr_t *hdr){
+    gc->nbuckets = GZ_NBUCKETS;
+    gc->buckets = Calloc(gc->nbuckets, sizeof(gzentry_t *));
+    gc->head = gc->tail = NULL;
+    gc->bytes = 0;
+    gc->max = max;
+    gc->hdr = hdr;
+    Sem_init(&gc->mutex, 0, 1);
+}
+
+/* Bytes ge holds, entries that saved nothing cost their bookkeeping */
+static size_t cost(gzentry_t *ge){
+    return sizeof(gzentry_t) + strlen(ge->filename) + 1 + ge->len;
+}
+
+static void free_entry(gzentry_t *ge){
+    Free(ge->data);
+    Free(ge->filename);
+    Free(ge);
+}
+
+static void lru_unlink(gzcache_t *gc, gzentry_t *ge){
+    if(ge->prev) ge->prev->next = ge->next;
+    else gc->head = ge->next;
+    if(ge->next) ge->next->prev = ge->prev;
+    else gc->tail = ge->prev;
+}
+
+static void lru_push(gzcache_t *gc, gzentry_t *ge){
+    ge->prev = NULL;
+    ge->next = gc->head;
+    if(gc->head) gc->head->prev = ge;
+    else gc->tail = ge;
+    gc->head = ge;
+}
+
+/* Drop ge from the cache, it is freed once the last request puts it back. */
+static void remove_entry(gzcache_t *gc, gzentry_t *ge){
+    gzentry_t **pp = &gc->buckets[hash(ge->filename) & (gc->nbuckets - 1)];
+
+    while(*pp != ge) pp = &(*pp)->hnext;
+    *pp = ge->hnext;
+    lru_unlink(gc, ge);
+    gc->bytes -= cost(ge);
+    ge->cached = 0;
+    if(ge->refcnt == 0) free_entry(ge);
+}
+
+static gzentry_t *lookup(gzcache_t *gc, fentry_t *fe){
+    gzentry_t *ge;
+
+    for(ge = gc->buckets[hash(fe->filename) & (gc->nbuckets - 1)]; ge; ge = ge->hnext){
+        if(strcmp(ge->filename, fe->filename)) continue;
+        if(ge->size == fe->st.st_size && ge->mtime.tv_sec == fe->st.st_mtim.tv_sec &&
+           ge->mtime.tv_nsec == fe->st.st_mtim.tv_nsec) return ge;
+        remove_entry(gc, ge);   /* the file changed since */
+        return NULL;
+    }
+    return NULL;
+}
+
+/* Compress the open file of fe into a new entry; its data stays NULL if
+   that does not save anything. */
+static gzentry_t *compress_file(gzcache_t *gc, fentry_t *fe){
+    gzentry_t *ge = Malloc(sizeof(gzentry_t));
+    size_t size = fe->st.st_size, bound;
+    char *src, gzname[MAXLINE];
+    z_stream zs;
+
+    ge->filename = Malloc(strlen(fe->filename) + 1);
+    strcpy(ge->filename, fe->filename);
+    ge->size = fe->st.st_size;
+    ge->mtime = fe->st.st_mtim;
+    ge->data = NULL;
+    ge->hdrlen = ge->len = 0;
+    ge->refcnt = 1;
+    ge->cached = 0;
+
+    src = Malloc(size ? size : 1);
+    if(pread(fe->fd, src, size, 0) != size){
+        Free(src);
+        return ge;
+    }
+    memset(&zs, 0, sizeof(zs));
+    // windowBits 15 + 16 writes a gzip header and trailer.
+    if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        Free(src);
+        return ge;
+    }
+    bound = deflateBound(&zs, size);
+    ge->data = Malloc(FC_HDRSIZE + bound);
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = size;
+    zs.next_out = (Bytef *)ge->data + FC_HDRSIZE;
+    zs.avail_out = bound;
+    if(deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= size){
+        Free(ge->data);
+        ge->data = NULL;
+    }
+    else{
+        snprintf(gzname, MAXLINE, "%s.gz", fe->filename);
+        ge->hdrlen = gc->hdr(ge->data, FC_HDRSIZE, gzname, zs.total_out);
+        memmove(ge->data + ge->hdrlen, ge->data + FC_HDRSIZE, zs.total_out);
+        ge->len = ge->hdrlen + zs.total_out;
+        ge->data = Realloc(ge->data, ge->len);
+    }
+    deflateEnd(&zs);
+    Free(src);
+    return ge;
+}
+
+/* The compressed form of the file open in fe, compressing it on a miss or
+   once it changed. Return a referenced entry that must be given back with
+   gzcache_put, or NULL if the file is too large. */
+gzentry_t *gzcache_get(gzcache_t *gc, fentry_t *fe){
+    unsigned long b = hash(fe->filename) & (gc->nbuckets - 1);
+    gzentry_t *ge, *other;
+
+    if(fe->st.st_size > GZ_MAXFILE) return NULL;
+    P(&gc->mutex);
+    if((ge = lookup(gc, fe)) != NULL){
+        lru_unlink(gc, ge);
+        lru_push(gc, ge);
+        ge->refcnt++;
+        V(&gc->mutex);
+        return ge;
+    }
+    V(&gc->mutex);
+
+    // compress without the lock, other requests go on meanwhile.
+    ge = compress_file(gc, fe);
+
+    P(&gc->mutex);
+    if((other = lookup(gc, fe)) != NULL){
+        /* Another request compressed it first */
+        other->refcnt++;
+        V(&gc->mutex);
+        free_entry(ge);
+        return other;
+    }
+    if(cost(ge) <= gc->max){
+        while(gc->bytes + cost(ge) > gc->max) remove_entry(gc, gc->tail);
+        ge->cached = 1;
+        ge->hnext = gc->buckets[b];
+        gc->buckets[b] = ge;
+        lru_push(gc, ge);
+        gc->bytes += cost(ge);
+    }
+    V(&gc->mutex);
+    return ge;
+}
+
+void gzcache_put(gzcache_t *gc, gzentry_t *ge){
+    P(&gc->mutex);
+    if(--ge->refcnt == 0 && !ge->cached) free_entry(ge);
+    V(&gc->mutex);
+}
@@ -0,0 +1,42 @@
+#ifndef __GZCACHE_H__
+#define __GZCACHE_H__
+
+#include "csapp.h"
+#include "fcache.h"
+
+#define GZ_MAXFILE (4 * 1024 * 1024)   /* larger files are sent as they are */
+
+/* Writes the response headers of filename, len bytes long, into buf;
+   called with the name of the ".gz" sibling the entry stands for */
+typedef int gz_hdr_t(char *buf, size_t size, char *filename, off_t len);
+
+/* A file compressed once, for as long as it keeps its size and mtime */
+typedef struct gzentry {
+    char *filename;
+    off_t size;                  /* of the file it was compressed from */
+    struct timespec mtime;
+    char *data;                  /* headers then the gzip'ed body, NULL if */
+    size_t hdrlen;               /*   compressing did not make it smaller */
+    size_t len;
+    int refcnt;                  /* requests still sending from data */
+    int cached;                  /* still reachable from the cache */
+    struct gzentry *hnext;       /* hash chain */
+    struct gzentry *prev, *next; /* LRU list, most recently used first */
+} gzentry_t;
+
+/* LRU cache of compressed files, bounded by the bytes it holds */
+typedef struct {
+    gzentry_t **buckets;
+    int nbuckets;
+    gzentry_t *head, *tail;
+    size_t bytes;
+    size_t max;
+    gz_hdr_t *hdr;
+    sem_t mutex;
+} gzcache_t;
+
+void gzcache_init(gzcache_t *gc, size_t max, gz_hdr_t *hdr);
+gzentry_t *gzcache_get(gzcache_t *gc, fentry_t *fe);
+void gzcache_put(gzcache_t *gc, gzentry_t *ge);
+
+#endif
@@ -0,0 +1,130 @@
+#include "http.h"
+
+/* Split "METHOD URI VERSION\r\n" in one pass over line. Return -1 if a
+   field is missing. */
+int reqline_parse(char *line, reqline_t *rl){
+    char *p = line;
+
+    rl->method = p;
+    while(*p != ' ' && *p != '\r' && *p != '\n' && *p) p++;
+    if(*p != ' ' || p == line) return -1;
+    *p++ = '\0';
+
+    rl->uri = p;
+    rl->query = NULL;
+    while(*p != ' ' && *p != '\r' && *p != '\n' && *p){
+        if(*p == '?' && rl->query == NULL){
+            rl->urilen = p - rl->uri;
+            *p = '\0';
+            rl->query = p + 1;
+        }
+        p++;
+    }
+    if(*p != ' ' || p == rl->uri) return -1;
+    if(rl->query == NULL){
+        rl->urilen = p - rl->uri;
+        rl->query = p;
+    }
+    *p++ = '\0';
+
+    rl->version = p;
+    while(*p != ' ' && *p != '\r' && *p != '\n' && *p) p++;
+    if(p == rl->version) return -1;
+    *p = '\0';
+    return 0;
+}
+
+/* Content types by extension. mime_init finds a seed under which every
+   extension hashes to its own slot, so a lookup is one hash and one
+   compare. */
+static struct {
+    char *ext;
+    char *type;
+    int compress;   /* worth sending gzip'ed */
+} mimes[] = {
+    { "html", "text/html",              1 },
+    { "htm",  "text/html",              1 },
+    { "gif",  "image/gif",              0 },
+    { "png",  "image/png",              0 },
+    { "jpg",  "image/jpeg",             0 },
+    { "jpeg", "image/jpeg",             0 },
+    { "css",  "text/css",               1 },
+    { "js",   "application/javascript", 1 },
+    { "json", "application/json",       1 },
+    { "xml",  "application/xml",        1 },
+    { "svg",  "image/svg+xml",          1 },
+    { "ico",  "image/x-icon",           0 },
+    { "txt",  "text/plain",             1 },
+    { "c",    "text/plain",             1 },
+    { "h",    "text/plain",             1 },
+    { "pdf",  "application/pdf",        0 },
+    { "gz",   "application/gzip",       0 },
+};
+#define NMIMES    (sizeof(mimes) / sizeof(mimes[0]))
+#define MIME_SLOTS 64
+
+static int mime_slots[MIME_SLOTS];  /* index into mimes + 1, 0 if empty */
+static unsigned int mime_seed;
+
+static unsigned int mime_hash(char *ext, size_t len, unsigned int seed){
+    unsigned int h = seed;
+
+    for(size_t i = 0; i < len; i++) h = (h ^ (unsigned char)ext[i]) * 16777619;
+    return h & (MIME_SLOTS - 1);
+}
+
+void mime_init(void){
+    for(mime_seed = 2166136261u; ; mime_seed++){
+        size_t i;
+
+        memset(mime_slots, 0, sizeof(mime_slots));
+        for(i = 0; i < NMIMES; i++){
+            unsigned int s = mime_hash(mimes[i].ext, strlen(mimes[i].ext), mime_seed);
+
+            if(mime_slots[s]) break;
+            mime_slots[s] = i + 1;
+        }
+        if(i == NMIMES) return;
+    }
+}
+
+/* The table index of the extension of the name in [name, end), -1 if
+   it has none we know. */
+static int mime_find(char *name, char *end){
+    char *ext = end;
+    size_t len;
+    int i;
+
+    while(ext > name && ext[-1] != '.' && ext[-1] != '/') ext--;
+    if(ext == name || ext[-1] != '.') return -1;
+    len = end - ext;
+    i = mime_slots[mime_hash(ext, len, mime_seed)] - 1;
+    if(i < 0 || strncmp(mimes[i].ext, ext, len) || mimes[i].ext[len]) return -1;
+    return i;
+}
+
+/* The content type of filename. A ".gz" sibling of a file worth
+   compressing has the type of that file and encoding "gzip", otherwise
+   encoding is NULL. */
+char *mime_type(char *filename, char **encoding){
+    char *end = filename + strlen(filename);
+    int i = mime_find(filename, end);
+
+    *encoding = NULL;
+    if(i >= 0 && !strcmp(mimes[i].ext, "gz")){
+        int j = mime_find(filename, end - 3);
+
+        if(j >= 0 && mimes[j].compress){
+            *encoding = "gzip";
+            return mimes[j].type;
+        }
+    }
+    return i >= 0 ? mimes[i].type : "text/plain";
+}
+
+/* Whether filename is worth sending gzip'ed. */
+int mime_compressible(char *filename){
+    int i = mime_find(filename, filename + strlen(filename));
+
+    return i >= 0 && mimes[i].compress;
+}
@@ -0,0 +1,22 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+#include "../encoding.h"
+
+/* A request line split in place, each field NUL terminated inside the line */
+typedef struct {
+    char *method;
+    char *uri;        /* path alone, the byte before it is free for the caller */
+    size_t urilen;
+    char *query;      /* what followed '?', "" if nothing did */
+    char *version;
+} reqline_t;
+
+int reqline_parse(char *line, reqline_t *rl);
+
+void mime_init(void);
+char *mime_type(char *filename, char **encoding);
+int mime_compressible(char *filename);
+
+#endif
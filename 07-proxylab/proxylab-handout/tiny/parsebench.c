@@ -0,0 +1,127 @@
+/*
+ * parsebench.c - time the request line parsing, URI routing and content
+ *     type lookup of tiny against the sscanf/strcpy/strstr code they
+ *     replaced
+ *
+ * usage: parsebench [iterations]
+ */
+#include "csapp.h"
+#include "http.h"
+
+static char *lines[] = {
+    "GET / HTTP/1.1\r\n",
+    "GET /home.html HTTP/1.1\r\n",
+    "GET /godzilla.gif HTTP/1.0\r\n",
+    "GET /cgi-bin/adder?15000&213 HTTP/1.1\r\n",
+    "GET /static/css/site.min.css HTTP/1.1\r\n",
+    "GET /images/photos/2019/vacation/beach-sunset-large.jpg HTTP/1.1\r\n",
+    "GET /csapp.c HTTP/1.0\r\n",
+    "GET /api/v1/items.json HTTP/1.1\r\n",
+};
+#define NLINES (sizeof(lines) / sizeof(lines[0]))
+
+/* What tiny did before */
+static int old_parse_uri(char *uri, char *filename, char *cgiargs)
+{
+    char *ptr;
+
+    if (!strstr(uri, "cgi-bin")) {
+	strcpy(cgiargs, "");
+	strcpy(filename, ".");
+	strcat(filename, uri);
+	if (uri[strlen(uri)-1] == '/')
+	    strcat(filename, "home.html");
+	return 1;
+    }
+    ptr = index(uri, '?');
+    if (ptr) {
+	strcpy(cgiargs, ptr+1);
+	*ptr = '\0';
+    }
+    else
+	strcpy(cgiargs, "");
+    strcpy(filename, ".");
+    strcat(filename, uri);
+    return 0;
+}
+
+static void old_get_filetype(char *filename, char *filetype)
+{
+    if (strstr(filename, ".html"))
+	strcpy(filetype, "text/html");
+    else if (strstr(filename, ".gif"))
+	strcpy(filetype, "image/gif");
+    else if (strstr(filename, ".png"))
+	strcpy(filetype, "image/png");
+    else if (strstr(filename, ".jpg"))
+	strcpy(filetype, "image/jpeg");
+    else
+	strcpy(filetype, "text/plain");
+}
+
+static long old_request(char *buf)
+{
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE], filetype[MAXLINE];
+
+    sscanf(buf, "%s %s %s", method, uri, version);
+    if (old_parse_uri(uri, filename, cgiargs))
+	old_get_filetype(filename, filetype);
+    else
+	filetype[0] = '\0';
+    return strlen(filename) + filetype[0];
+}
+
+/* What tiny does now, as in doit and parse_uri */
+static long new_request(char *buf)
+{
+    char path[MAXLINE], *filename, *type = "", *encoding;
+    reqline_t rl;
+
+    if (reqline_parse(buf, &rl) < 0)
+	return 0;
+    filename = rl.uri - 1;
+    *filename = '.';
+    if (strncmp(rl.uri, "/cgi-bin/", 9)) {
+	if (rl.uri[rl.urilen - 1] == '/') {
+	    memcpy(path, filename, rl.urilen + 1);
+	    strcpy(path + rl.urilen + 1, "home.html");
+	    filename = path;
+	}
+	type = mime_type(filename, &encoding);
+    }
+    return strlen(filename) + type[0];
+}
+
+static double run(long (*request)(char *), long iters, long *sink)
+{
+    char buf[MAXLINE];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iters; i++) {
+	char *line = lines[i % NLINES];
+
+	/* Both parse in a buffer of their own, as off the rio buffer */
+	strcpy(buf, line);
+	*sink += request(buf);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iters;
+}
+
+int main(int argc, char **argv)
+{
+    long iters = argc > 1 ? atol(argv[1]) : 2000000, sink = 0;
+    double old_ns, new_ns;
+
+    mime_init();
+    run(old_request, iters / 10, &sink);   /* warm up */
+    run(new_request, iters / 10, &sink);
+    old_ns = run(old_request, iters, &sink);
+    new_ns = run(new_request, iters, &sink);
+    printf("sscanf/strstr:       %7.1f ns/request\n", old_ns);
+    printf("tokenizer/mime hash: %7.1f ns/request\n", new_ns);
+    printf("saved %.1f ns/request (%.1fx) [%ld]\n", old_ns - new_ns, old_ns / new_ns, sink & 1);
+    return 0;
+}
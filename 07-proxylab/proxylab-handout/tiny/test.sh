@@ -0,0 +1,158 @@
+#!/bin/bash
+#
+# test.sh - Request the corner cases of Tiny in each of its modes and
+#     check the status codes it answers with.
+#
+#     usage: ./test.sh [port]
+#
+
+PORT=${1:-$((( RANDOM % 30000) + 20000))}
+TIMEOUT=5
+MAXLINE=8192
+MODES="iterative prethreaded epoll"
+failed=0
+
+#
+# status - the status code Tiny answers a GET of uri with
+# usage: status <uri> [curl options]
+#
+function status {
+    uri=$1
+    shift
+    curl --max-time ${TIMEOUT} --silent --output /dev/null \
+         --write-out "%{http_code}" "$@" "http://localhost:${PORT}${uri}"
+}
+
+#
+# header - the value of a header of Tiny's answer to a GET of uri,
+#     "none" if it has none
+# usage: header <uri> <name> [curl options]
+#
+function header {
+    uri=$1
+    name=$2
+    shift 2
+    got=`curl --max-time ${TIMEOUT} --silent --dump-header - --output /dev/null \
+         "$@" "http://localhost:${PORT}${uri}" \
+         | grep -i "^${name}:" | cut -d' ' -f2 | tr -d '\r'`
+    echo ${got:-none}
+}
+
+#
+# encoding - the Content-Encoding Tiny answers a GET of uri with, given
+#     an Accept-Encoding header
+# usage: encoding <uri> <accept-encoding>
+#
+function encoding {
+    header $1 Content-Encoding --header "Accept-Encoding: $2"
+}
+
+#
+# raw_status - the status code Tiny answers request with, its escapes
+#     such as \r\n expanded and nothing else added
+# usage: raw_status <request>
+#
+function raw_status {
+    exec 3<> /dev/tcp/localhost/${PORT}
+    printf "%b" "$1" >&3
+    read -t ${TIMEOUT} version code rest <&3
+    exec 3<&-
+    echo ${code}
+}
+
+#
+# expect - report a check of what Tiny answered against what it should
+# usage: expect <name> <want> <got>
+#
+function expect {
+    if [ "$2" == "$3" ]; then
+        echo "  ok   $1"
+    else
+        echo "  FAIL $1: expected $2, got $3"
+        failed=1
+    fi
+}
+
+#
+# slash_uri - a URI of n bytes ending in '/'
+# usage: slash_uri <n>
+#
+function slash_uri {
+    printf "/%0$(( $1 - 2 ))d/" 0
+}
+
+if [ ! -x ./tiny ]; then
+    echo "Error: ./tiny not found, run make first."
+    exit 1
+fi
+
+# A file larger than the socket buffers can hold
+BIGFILE=test-big.txt
+truncate -s 64M ${BIGFILE}
+trap "rm -f ${BIGFILE}" EXIT
+
+for mode in ${MODES}
+do
+    echo "Mode ${mode}:"
+    ./tiny -m ${mode} -g ${PORT} > /dev/null 2>&1 &
+    tiny_pid=$!
+    for i in 1 2 3 4 5; do
+        status /home.html > /dev/null && break
+        sleep 1
+    done
+
+    # The default page appended to a directory must fit the filename buffer
+    expect "longest URI ending in '/'" 404 \
+        $(status $(slash_uri $(( MAXLINE - 1 - 10 ))))
+    expect "URI ending in '/' one byte longer" 414 \
+        $(status $(slash_uri $(( MAXLINE - 10 ))))
+    # The longest URI that fits a request line in Tiny's MAXLINE buffer,
+    # the shortest method and version around it
+    expect "maximal URI ending in '/'" 414 \
+        $(raw_status "GET $(slash_uri $(( MAXLINE - 1 - 6 ))) X\r\n\r\n")
+    expect "still serving" 200 $(status /home.html)
+
+    # Serving one client at a time, a kept connection would hold off
+    # the rest
+    if [ ${mode} == "iterative" ]; then
+        keep=close
+    else
+        keep=none
+    fi
+    expect "Connection header of HTTP/1.1" ${keep} $(header /home.html Connection)
+
+    # A client that does not read its response must not hold up the
+    # others, which only serving one client at a time does
+    if [ ${mode} != "iterative" ]; then
+        exec 4<> /dev/tcp/localhost/${PORT}
+        printf "GET /${BIGFILE} HTTP/1.1\r\n\r\n" >&4
+        sleep 1
+        expect "while a client does not read" 200 $(status /home.html)
+        exec 4<&-
+
+        status "/gen?size=10&delay_us=3000000" > /dev/null &
+        sleep 1
+        expect "while a response waits out its delay" 200 \
+            $(status /home.html --max-time 1)
+        wait $!
+    fi
+
+    expect "synthetic body" 3000000 \
+        $(curl --max-time ${TIMEOUT} --silent "http://localhost:${PORT}/gen?size=3000000" | wc -c)
+    expect "chunked synthetic body" 3000000 \
+        $(curl --max-time ${TIMEOUT} --silent "http://localhost:${PORT}/gen?size=3000000&chunked=1" | wc -c)
+
+    # "*" stands for gzip unless gzip itself is refused
+    expect "Accept-Encoding: gzip" gzip $(encoding /tiny.c "gzip")
+    expect "Accept-Encoding: *" gzip $(encoding /tiny.c "*")
+    expect "Accept-Encoding: *;q=0.5" gzip $(encoding /tiny.c "*;q=0.5")
+    expect "Accept-Encoding: *, gzip;q=0" none $(encoding /tiny.c "*, gzip;q=0")
+    expect "Accept-Encoding: gzip;q=0, *" none $(encoding /tiny.c "gzip;q=0, *")
+    expect "Accept-Encoding: *;q=0" none $(encoding /tiny.c "*;q=0")
+    expect "Accept-Encoding: deflate" none $(encoding /tiny.c "deflate")
+
+    kill ${tiny_pid}
+    wait ${tiny_pid} 2> /dev/null
+done
+
+exit ${failed}
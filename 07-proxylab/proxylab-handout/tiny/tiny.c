@@ -1,245 +1,1334 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
+ * tiny.c - A simple HTTP/1.1 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *     Connections stay open for further, possibly pipelined,
+ *     requests until the client asks to close or goes idle.
+ *     It is iterative by default, -m prethreaded serves clients from
+ *     a pool of threads and -m epoll from an event loop.
  *
  * Updated 11/2019 droh 
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
  */
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "arena.h"
+#include "cgipool.h"
+#include "http.h"
+#include "gzcache.h"
+#include "accesslog.h"
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
-int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
+/* Concurrency modes, selected with -m */
+#define MODE_ITERATIVE   0
+#define MODE_PRETHREADED 1
+#define MODE_EPOLL       2
+
+#define NTHREADS  16  /* Default worker threads in prethreaded mode */
+#define SBUFSIZE  64  /* Accepted connections waiting for a worker */
+#define MAXEVENTS 64  /* Events per epoll_wait() */
+
+#define CGI_WORKERS 4 /* Default persistent workers per CGI program */
+
+#define GEN_BUFSIZE (1 << 20) /* Synthetic body written at a time (-g) */
+#define GEN_MAXSIZE (1L << 34) /* Largest synthetic body */
+
+#define KEEPALIVE_TIMEOUT 5 /* Seconds a persistent connection may stay idle */
+#define HEADER_TIMEOUT   10 /* Seconds a client may take to send a request head */
+
+#define FCACHE_SIZE     256 /* Open files kept for static content */
+#define FCACHE_INTERVAL 1   /* Seconds between checks that a file changed */
+#define GZCACHE_SIZE (16 * 1024 * 1024) /* Bytes of compressed files kept */
+
+int accept_client(int listenfd);
+void serve_iterative(int listenfd);
+void serve_prethreaded(int listenfd, int nthreads);
+void *worker(void *vargp);
+void serve_epoll(int listenfd);
+void serve_conn(int fd);
+int wait_ready(int fd, short events, int ms);
+int read_head(int fd, rio_t *rp);
+int head_buffered(rio_t *rp);
+int read_requesthdrs(rio_t *rp, int *keepalive, long *bodylen, int *gzip);
+int connection_option(char *value, int keepalive);
+char *conn_header(int keepalive, char *version);
+int parse_uri(reqline_t *rl, char **filename, char *buf);
+void gen_init(void);
+void *reload_thread(void *vargp);
+int static_headers(char *buf, size_t size, char *filename, off_t filesize);
+int preload_headers(char *buf, size_t size, char *filename, off_t filesize);
+void fcache_headers(fentry_t *fe);
+void set_cork(int fd, int on);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg);
+void detach_dynamic(int fd, char *filename, char *cgiargs);
+void *dynamic_thread(void *vargp);
+
+/* A response on its way out: the buffers in iov, then the rest of a
+   file. The blocking modes write it in full, the event loop as far as
+   the socket takes it and again once the socket has room. */
+typedef struct {
+    int pending;             /* made and not yet finished */
+    int fd;
+    struct iovec iov[3];     /* headers, and the body where it is in memory */
+    int iovcnt;
+    char hdr[MAXLINE];       /* headers made for this response alone */
+    char body[MAXBUF];       /* an error page */
+    int srcfd;               /* file sent after iov, -1 if none */
+    off_t offset;            /* how far into it */
+    off_t filesize;
+    char *map;               /* the file mapped, where sendfile() would not do */
+    long gensize;            /* synthetic bytes still to send after iov */
+    int chunked;             /* and whether they go in chunks */
+    char chunk[24];          /* the size line of the chunk in iov */
+    long delay;              /* microseconds to wait before any of it goes */
+    int corked;
+    fentry_t *fe;            /* held until the response is sent */
+    gzentry_t *ge;
+    arena_t *ap;
+    int status;
+    char request[LOG_REQUEST]; /* the request line, for the log */
+    struct timespec start;
+} resp_t;
+
+int doit(int fd, rio_t *rp, resp_t *r);
+int serve_request(int fd, rio_t *rp, char *buf, resp_t *r);
+void serve_static(resp_t *r, fentry_t *fe, char *tail);
+int serve_preloaded(resp_t *r, char *filename, int gzip, char *tail);
+void serve_gzip(resp_t *r, fentry_t *fe, char *tail);
+void serve_generated(resp_t *r, char *query, int chunked_ok, char *tail);
+void gen_next(resp_t *r);
+void clienterror(resp_t *r, char *cause, char *errnum, 
+		 char *shortmsg, char *longmsg, char *tail);
+void resp_init(resp_t *r, int fd, char *request);
+void resp_add(resp_t *r, void *base, size_t len);
+int resp_trysend(rio_t *rp, resp_t *r);
+int send_response(rio_t *rp, resp_t *r);
+void resp_done(resp_t *r);
+
+/* A CGI request the event loop hands to a thread of its own */
+typedef struct {
+    int fd;        /* a duplicate of the connection, the loop closes its own */
+    char *filename;
+    char *cgiargs;
+} cgijob_t;
+
+/* A connection of the event loop */
+typedef struct conn {
+    int fd;
+    rio_t rio;     /* keeps what the client pipelined ahead */
+    resp_t *out;   /* the response being written, NULL if none */
+    int keep;      /* whether another request may follow it */
+    int events;    /* what the loop waits for on fd */
+    time_t last;   /* when its last request was answered, or it took more of a response */
+    time_t since;  /* when the head still being read began, 0 if none */
+    int delayed;   /* its response waits out a delay on the loop's list */
+    struct timespec ready;  /* when that delay is over */
+    struct conn *dnext;
+} conn_t;
+
+/* The state of the event loop besides its connections */
+typedef struct {
+    int epfd;
+    resp_t *spare;     /* for the next response, most are sent at once */
+    conn_t *delayed;   /* connections whose response waits out a delay */
+} loop_t;
+
+int conn_run(loop_t *lp, conn_t *c, int events);
+int conn_write(loop_t *lp, conn_t *c);
+void conn_watch(loop_t *lp, conn_t *c, int events);
+void conn_close(loop_t *lp, conn_t *c);
+int loop_timeout(loop_t *lp);
+
+sbuf_t sbuf;     /* Connections for the worker threads */
+fcache_t fcache; /* Open static files */
+gzcache_t gzcache; /* Static files compressed once */
+char *preload_dir = NULL; /* Tree preloaded into memory (-p), reloaded on SIGHUP */
+char *gen_buf = NULL;     /* Synthetic body served under /gen (-g), NULL if off */
+sigset_t reload_mask;
+int event_loop = 0;       /* set in epoll mode, CGI then runs off the loop */
+int keep_conns = 1;       /* whether connections may carry more than one request */
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd, opt, mode = MODE_ITERATIVE, nthreads = NTHREADS;
+    int cgiworkers = CGI_WORKERS;
+    sockopts_t opts = {0};
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "m:t:p:c:go:")) != -1) {
+	switch (opt) {
+	case 'm':
+	    if (!strcmp(optarg, "iterative"))
+		mode = MODE_ITERATIVE;
+	    else if (!strcmp(optarg, "prethreaded"))
+		mode = MODE_PRETHREADED;
+	    else if (!strcmp(optarg, "epoll"))
+		mode = MODE_EPOLL;
+	    else
+		argc = 0;
+	    break;
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'p':
+	    preload_dir = optarg;
+	    break;
+	case 'c':
+	    cgiworkers = atoi(optarg);
+	    break;
+	case 'g':
+	    gen_init();
+	    break;
+	case 'o':
+	    if (sockopts_parse(&opts, optarg) < 0)
+		argc = 0;
+	    break;
+	default:
+	    argc = 0;
+	}
+    }
+    if (optind != argc - 1 || nthreads <= 0 || cgiworkers < 0) {
+	fprintf(stderr, "usage: %s [-m iterative|prethreaded|epoll] [-t nthreads] "
+		"[-p preload_dir] [-c cgi_workers] [-g] "
+		"[-o sockopt[=value],...] <port>\n", argv[0]);
 	exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    /* A client that goes away mid-response must not take the server with it */
+    Signal(SIGPIPE, SIG_IGN);
+    listenfd = Open_listenfd_opts(argv[optind], &opts);
+    fcache_init(&fcache, FCACHE_SIZE, FCACHE_INTERVAL, fcache_headers);
+    gzcache_init(&gzcache, GZCACHE_SIZE, static_headers);
+    cgipool_init(cgiworkers);
+    accesslog_init(STDOUT_FILENO);
+    mime_init();
+    if (preload_dir) {
+	/* Only the reload thread takes SIGHUP, block it before any thread starts */
+	Sigemptyset(&reload_mask);
+	Sigaddset(&reload_mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &reload_mask, NULL);
+	arena_publish(arena_load(preload_dir, preload_headers));
+	Pthread_create(&tid, NULL, reload_thread, NULL);
+    }
+    if (mode == MODE_PRETHREADED)
+	serve_prethreaded(listenfd, nthreads);
+    else if (mode == MODE_EPOLL)
+	serve_epoll(listenfd);
+    else
+	serve_iterative(listenfd);
+}
+
+/*
+ * accept_client - accept a connection and log where it came from
+ */
+int accept_client(int listenfd)
+{
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE], note[LOG_REQUEST];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+
+    clientlen = sizeof(clientaddr);
+    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
+    Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+                port, MAXLINE, 0);
+    snprintf(note, LOG_REQUEST, "Accepted connection from (%.64s, %.16s)", hostname, port);
+    accesslog(note, 0, 0);
+    return connfd;
+}
+
+/*
+ * serve_iterative - serve one client at a time, the original Tiny.
+ *     A kept connection would hold off every other client until it
+ *     went idle, so each one answers a single request and is closed.
+ */
+void serve_iterative(int listenfd)
+{
+    int connfd;
+
+    keep_conns = 0;
     while (1) {
-	clientlen = sizeof(clientaddr);
-	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
+	connfd = accept_client(listenfd);
+	serve_conn(connfd);                                       //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
+
+/*
+ * serve_prethreaded - the main thread accepts connections and a pool
+ *     of worker threads serves them
+ */
+void serve_prethreaded(int listenfd, int nthreads)
+{
+    pthread_t tid;
+
+    sbuf_init(&sbuf, SBUFSIZE);
+    for (int i = 0; i < nthreads; i++)
+	Pthread_create(&tid, NULL, worker, NULL);
+    while (1)
+	sbuf_add(&sbuf, accept_client(listenfd));
+}
+
+void *worker(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
+	int connfd = sbuf_remove(&sbuf);
+	serve_conn(connfd);
+	Close(connfd);
+    }
+}
+
+/*
+ * serve_epoll - single-threaded event loop: a connection is only served
+ *     once its request head has arrived, and its response is written
+ *     as far as the socket takes it, the rest once the socket has room,
+ *     so neither slow senders nor slow readers hold up the others
+ */
+void serve_epoll(int listenfd)
+{
+    int connfd, fd, n, nconns = 0;
+    struct epoll_event ev, events[MAXEVENTS];
+    conn_t **conns = NULL, *c, **cp;   /* indexed by descriptor */
+    loop_t loop = { .spare = NULL, .delayed = NULL };
+    struct timespec ts;
+    time_t now, swept = time(NULL);
+
+    event_loop = 1;
+
+    if ((loop.epfd = epoll_create1(0)) < 0)
+	unix_error("epoll_create1 error");
+    ev.events = EPOLLIN;
+    ev.data.fd = listenfd;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+
+    while (1) {
+	/* Wake up at least once a second to expire idle connections,
+	   sooner for the first delayed response */
+	if ((n = epoll_wait(loop.epfd, events, MAXEVENTS, loop_timeout(&loop))) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for (int i = 0; i < n; i++) {
+	    if (events[i].data.fd == listenfd) {
+		connfd = accept_client(listenfd);
+		if (connfd >= nconns) {
+		    conns = Realloc(conns, 2 * (connfd + 1) * sizeof(conn_t *));
+		    memset(conns + nconns, 0, (2 * (connfd + 1) - nconns) * sizeof(conn_t *));
+		    nconns = 2 * (connfd + 1);
+		}
+		/* Neither reads nor writes may hold up the loop */
+		fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+		c = conns[connfd] = Malloc(sizeof(conn_t));
+		c->fd = connfd;
+		Rio_readinitb(&c->rio, connfd);
+		c->out = NULL;
+		c->events = EPOLLIN;
+		c->last = time(NULL);
+		c->since = 0;
+		c->delayed = 0;
+		ev.events = EPOLLIN;
+		ev.data.fd = connfd;
+		if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+		    unix_error("epoll_ctl error");
+	    }
+	    else if ((c = conns[events[i].data.fd]) != NULL &&
+		     !conn_run(&loop, c, events[i].events)) {
+		conns[c->fd] = NULL;
+		conn_close(&loop, c);
+	    }
+	}
+	/* Send the responses whose delay is over */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (cp = &loop.delayed; (c = *cp) != NULL; ) {
+	    if (c->ready.tv_sec > ts.tv_sec ||
+		(c->ready.tv_sec == ts.tv_sec && c->ready.tv_nsec > ts.tv_nsec)) {
+		cp = &c->dnext;
+		continue;
+	    }
+	    *cp = c->dnext;
+	    c->delayed = 0;
+	    if (!conn_run(&loop, c, 0)) {
+		conns[c->fd] = NULL;
+		conn_close(&loop, c);
+	    }
+	}
+	/* Drop connections idle for too long, slow to send a request
+	   head, or taking no more of a response */
+	if ((now = time(NULL)) != swept) {
+	    swept = now;
+	    for (fd = 0; fd < nconns; fd++)
+		if ((c = conns[fd]) && !c->delayed &&
+		    (now - c->last >= KEEPALIVE_TIMEOUT ||
+		     (!c->out && c->since && now - c->since >= HEADER_TIMEOUT))) {
+		    conns[fd] = NULL;
+		    conn_close(&loop, c);
+		}
+	}
+    }
+}
+
+/*
+ * conn_run - move a connection of the event loop along on events:
+ *     finish the response it is writing, then answer the requests
+ *     whose heads are in its buffer, until one has to wait for room in
+ *     the socket. Return 0 once the connection is to be closed.
+ */
+int conn_run(loop_t *lp, conn_t *c, int events)
+{
+    int rc, full = 0, served = 0;
+    ssize_t n;
+
+    /* Waiting out a delay only the client hanging up counts */
+    if (c->delayed)
+	return !(events & (EPOLLHUP | EPOLLERR));
+    if (c->out != NULL) {
+	/* Nothing more is read until the response under way is out */
+	if ((rc = conn_write(lp, c)) <= 0)
+	    return rc == 0;
+	if (!c->keep)
+	    return 0;
+	served = 1;
+    }
+    else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+	/* Take whatever has arrived, a request is only served once
+	   its head is all in the buffer so that doit never waits */
+	n = rio_tryreadb(&c->rio);
+	full = n < 0 && errno == ENOBUFS;
+	if (!(n > 0 || full || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))))
+	    return 0;
+	c->last = time(NULL);
+    }
+
+    /* Pipelined requests already sitting in the buffer raise no
+       further event, answer them now. A head too large for the
+       buffer goes to doit as it is, to be turned away. */
+    while (full || head_buffered(&c->rio)) {
+	full = 0;
+	served = 1;
+	c->out = lp->spare != NULL ? lp->spare : Malloc(sizeof(resp_t));
+	lp->spare = NULL;
+	c->keep = doit(c->fd, &c->rio, c->out);
+	if ((rc = conn_write(lp, c)) <= 0)
+	    return rc == 0;
+	if (!c->keep)
+	    return 0;
+    }
+
+    /* A head trickling in keeps the connection busy but not for
+       longer than HEADER_TIMEOUT */
+    if (c->rio.rio_cnt == 0)
+	c->since = 0;
+    else if (served || !c->since)
+	c->since = c->last;
+    rio_release(&c->rio);   /* kept while part of a request is in */
+    return 1;
+}
+
+/*
+ * conn_write - write as much of c's response as its socket takes.
+ *     Return 1 once it is all out, 0 if the loop is to wait for room
+ *     in the socket or for the response's delay, -1 if the client is
+ *     gone.
+ */
+int conn_write(loop_t *lp, conn_t *c)
+{
+    resp_t *r = c->out;
+    int rc = 1;
+
+    if (r->pending && r->delay > 0) {
+	/* Nothing to wait on but the clock, the loop's timeout covers it */
+	clock_gettime(CLOCK_MONOTONIC, &c->ready);
+	c->ready.tv_sec += r->delay / 1000000;
+	if ((c->ready.tv_nsec += r->delay % 1000000 * 1000) >= 1000000000) {
+	    c->ready.tv_sec++;
+	    c->ready.tv_nsec -= 1000000000;
+	}
+	r->delay = 0;
+	c->delayed = 1;
+	c->dnext = lp->delayed;
+	lp->delayed = c;
+	conn_watch(lp, c, 0);
+	return 0;
+    }
+    if (r->pending && resp_trysend(&c->rio, r) < 0) {
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	    c->last = time(NULL);   /* it took some, or has only just begun */
+	    conn_watch(lp, c, EPOLLOUT);
+	    return 0;
+	}
+	rc = -1;
+    }
+    if (r->pending)
+	resp_done(r);
+    c->out = NULL;
+    if (lp->spare == NULL)
+	lp->spare = r;
+    else
+	Free(r);
+    c->last = time(NULL);
+    conn_watch(lp, c, EPOLLIN);
+    return rc;
+}
+
+/*
+ * conn_watch - have the loop wait for events on c, reading while it
+ *     has no response to write, writing while it has one, neither
+ *     while the response waits out a delay
+ */
+void conn_watch(loop_t *lp, conn_t *c, int events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events)
+	return;
+    ev.events = events;
+    ev.data.fd = c->fd;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+    c->events = events;
+}
+
+/*
+ * conn_close - drop a connection of the event loop with whatever it
+ *     had left to write
+ */
+void conn_close(loop_t *lp, conn_t *c)
+{
+    conn_t **cp;
+
+    if (c->delayed) {
+	for (cp = &lp->delayed; *cp != c; cp = &(*cp)->dnext)
+	    ;
+	*cp = c->dnext;
+    }
+    if (c->out != NULL) {
+	if (c->out->pending)
+	    resp_done(c->out);
+	Free(c->out);
+    }
+    /* A CGI thread may hold a duplicate, which would keep the
+       descriptor in the epoll set after it is closed */
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    rio_freeb(&c->rio);
+    Close(c->fd);
+    Free(c);
+}
+
+/*
+ * loop_timeout - the milliseconds the loop may sleep: until the first
+ *     delayed response is due, rounded up, and a second at most so that
+ *     idle connections are expired
+ */
+int loop_timeout(loop_t *lp)
+{
+    struct timespec now;
+    long long ns;
+    int timeout = 1000;
+
+    if (lp->delayed == NULL)
+	return timeout;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (conn_t *c = lp->delayed; c != NULL; c = c->dnext) {
+	ns = (c->ready.tv_sec - now.tv_sec) * 1000000000LL + (c->ready.tv_nsec - now.tv_nsec);
+	if (ns <= 0)
+	    return 0;
+	if ((ns + 999999) / 1000000 < timeout)
+	    timeout = (ns + 999999) / 1000000;
+    }
+    return timeout;
+}
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * serve_conn - answer the requests of a connection in order until the
+ *     client asks to close it, leaves it idle for KEEPALIVE_TIMEOUT or
+ *     takes longer than HEADER_TIMEOUT to send a request head
  */
-/* $begin doit */
-void doit(int fd) 
+void serve_conn(int fd)
 {
-    int is_static;
-    struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
     rio_t rio;
+    resp_t r;
+    int keep;
 
-    /* Read request line and headers */
     Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
-    if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Tiny does not implement this method");
-        return;
+    /* Requests the client pipelined are already in the buffer,
+       only wait on the socket once it has run dry */
+    while (read_head(fd, &rio)) {
+	keep = doit(fd, &rio, &r);
+	if (send_response(&rio, &r) < 0 || !keep)
+	    break;
+	if (rio.rio_cnt > 0)
+	    continue;
+	rio_release(&rio);  /* no need to hold a buffer while idle */
+	if (!wait_ready(fd, POLLIN, KEEPALIVE_TIMEOUT * 1000))
+	    break;
+    }
+    rio_freeb(&rio);
+}
+
+/*
+ * wait_ready - wait up to ms milliseconds (-1 for ever) for fd to be
+ *     ready for events, return 0 on timeout
+ */
+int wait_ready(int fd, short events, int ms)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    while ((n = poll(&pfd, 1, ms)) < 0 && errno == EINTR)
+	;
+    return n > 0;
+}
+
+/*
+ * read_head - read until the head of the next request is all in the
+ *     rio buffer, or fills it, for at most HEADER_TIMEOUT. Return 0 if
+ *     the client runs out of time or closes first.
+ */
+int read_head(int fd, rio_t *rp)
+{
+    struct timespec now, deadline;
+    long ms;
+    ssize_t rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += HEADER_TIMEOUT;
+    while (!head_buffered(rp)) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms <= 0 || !wait_ready(fd, POLLIN, ms))
+	    return 0;
+	if ((rc = rio_tryreadb(rp)) == 0)
+	    return 0;
+	if (rc < 0 && errno == ENOBUFS)
+	    return 1;   /* too large, doit turns it away */
+	if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * head_buffered - whether the request line and headers of the next
+ *     request, up to their blank line, are all in the rio buffer
+ */
+int head_buffered(rio_t *rp)
+{
+    char *p = rp->rio_bufptr, *end = rp->rio_bufptr + rp->rio_cnt;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+	if (++p < end && *p == '\n')
+	    return 1;
+	if (end - p >= 2 && p[0] == '\r' && p[1] == '\n')
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * doit - read one HTTP request and make its response in r, for the
+ *     caller to send; return 1 if the connection can carry another one
+ */
+/* $begin doit */
+int doit(int fd, rio_t *rp, resp_t *r)
+{
+    char buf[MAXLINE];
+
+    /* Read request line */
+    r->pending = 0;
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)  //line:netp:doit:readrequest
+        return 0;
+    resp_init(r, fd, buf);
+    return serve_request(fd, rp, buf, r);
+}
+/* $end doit */
+
+/*
+ * serve_request - read the headers of the request whose line is in buf
+ *     and make its response in r. Return 1 if the connection can carry
+ *     another request.
+ */
+int serve_request(int fd, rio_t *rp, char *buf, resp_t *r)
+{
+    int is_static, keepalive, gzip, rc;
+    long bodylen;
+    ssize_t n;
+    struct stat sbuf;
+    char path[MAXLINE], *filename, *tail, *body;
+    reqline_t rl;
+    fentry_t *fe;
+
+    if (reqline_parse(buf, &rl) < 0) {                   //line:netp:doit:parserequest
+        r->status = 400;
+        clienterror(r, buf, "400", "Bad Request",
+                    "Tiny couldn't parse the request", conn_header(0, ""));
+        return 0;
+    }
+    if (strcasecmp(rl.method, "GET")) {                  //line:netp:doit:beginrequesterr
+        r->status = 501;
+        clienterror(r, rl.method, "501", "Not Implemented",
+                    "Tiny does not implement this method", conn_header(0, rl.version));
+        return 0;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    keepalive = !strcmp(rl.version, "HTTP/1.1");         /* 1.0 has to ask for it */
+    r->status = 400;                                       /* until it is all read */
+    if ((rc = read_requesthdrs(rp, &keepalive, &bodylen, &gzip)) < 0) { //line:netp:doit:readrequesthdrs
+        if (rc == -2) {
+            r->status = 431;
+            clienterror(r, rl.uri, "431", "Request Header Fields Too Large",
+                        "Tiny couldn't fit a header in its buffer", conn_header(0, rl.version));
+        }
+        return 0;
+    }
+    keepalive = keepalive && keep_conns;
+    /* A GET has no use for a body, but it must not be read as the next request */
+    for (; bodylen > 0; bodylen -= n) {
+        if ((n = rio_peekn(rp, &body, bodylen)) <= 0)
+            return 0;
+        rio_consume(rp, n);                              /* skipped, never copied */
+    }
+    r->status = 200;
+    tail = conn_header(keepalive, rl.version);
 
-    /* Parse URI from GET request */
-    is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
-    if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
-	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
-    }                                                    //line:netp:doit:endnotfound
+    /* Synthetic responses for benchmarks, no file behind them */
+    if (gen_buf && !strcmp(rl.uri, "/gen")) {
+	serve_generated(r, rl.query, !strcmp(rl.version, "HTTP/1.1"), tail);
+	return keepalive;
+    }
 
-    if (is_static) { /* Serve static content */          
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
-	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+    /* Parse URI from GET request */
+    is_static = parse_uri(&rl, &filename, path);         //line:netp:doit:staticcheck
+    if (is_static < 0) {
+	r->status = 414;
+	clienterror(r, rl.uri, "414", "URI Too Long",
+		    "Tiny couldn't fit the file name", tail);
+	return keepalive;
     }
-    else { /* Serve dynamic content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
-	    return;
+    if (is_static) { /* Serve static content from memory or an already open file */
+	gzip = gzip && mime_compressible(filename);
+	if (serve_preloaded(r, filename, gzip, tail))
+	    return keepalive;
+	if ((fe = fcache_get(&fcache, filename)) == NULL) {
+	    r->status = 404;
+	    clienterror(r, filename, "404", "Not found",
+			"Tiny couldn't find this file", tail);
+	    return keepalive;
+	}
+	if (!(S_ISREG(fe->st.st_mode)) || !(S_IRUSR & fe->st.st_mode) || fe->fd < 0) { //line:netp:doit:readable
+	    fcache_put(&fcache, fe);
+	    r->status = 403;
+	    clienterror(r, filename, "403", "Forbidden",
+			"Tiny couldn't read the file", tail);
+	    return keepalive;
 	}
-	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
+	/* r holds on to fe until the file is sent */
+	if (gzip)
+	    serve_gzip(r, fe, tail);
+	else
+	    serve_static(r, fe, tail);                   //line:netp:doit:servestatic
+	return keepalive;
     }
+
+    /* Serve dynamic content */
+    if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
+	r->status = 404;
+	clienterror(r, filename, "404", "Not found",
+		    "Tiny couldn't find this file", tail);
+	return keepalive;
+    }                                                    //line:netp:doit:endnotfound
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
+	r->status = 403;
+	clienterror(r, filename, "403", "Forbidden",
+		    "Tiny couldn't run the CGI program", tail);
+	return keepalive;
+    }
+    /* The CGI program writes the rest of the headers and the body without
+       a length, so the end of the connection is the end of the response */
+    if (event_loop)
+	detach_dynamic(fd, filename, rl.query);
+    else
+	serve_dynamic(fd, filename, rl.query);           //line:netp:doit:servedynamic
+    return 0;
 }
-/* $end doit */
+
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers, noting whether the
+ *     client wants the connection kept, the length of any body and
+ *     whether it takes gzip. Returns -1 if the connection ends first,
+ *     -2 if a header does not fit in the rio buffer.
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp, int *keepalive, long *bodylen, int *gzip)
 {
-    char buf[MAXLINE];
+    char *buf;
+    ssize_t n;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
-    }
-    return;
+    *bodylen = 0;
+    *gzip = 0;
+    do {
+	/* Look at each header where it lies in the rio buffer */
+	if ((n = rio_peekline(rp, &buf)) <= 0)
+	    return -1;
+	if (buf[n - 1] != '\n')  /* cut short by a full buffer, or by EOF */
+	    return n >= RIO_MAXBUFSIZE ? -2 : -1;
+	rio_consume(rp, n);
+	buf[n - 1] = '\0';  /* the line is ours until the next peek */
+	if (!strncasecmp(buf, "Connection:", 11))
+	    *keepalive = connection_option(buf + 11, *keepalive);
+	else if (!strncasecmp(buf, "Content-length:", 15))
+	    *bodylen = atol(buf + 15);
+	else if (!strncasecmp(buf, "Accept-Encoding:", 16))
+	    *gzip = accepts_gzip(buf + 16);
+    } while (strcmp(buf, "\r") && n > 1); //line:netp:readhdrs:checkterm
+    return 0;
 }
 /* $end read_requesthdrs */
 
 /*
- * parse_uri - parse URI into filename and CGI args
- *             return 0 if dynamic content, 1 if static
+ * connection_option - apply the comma separated options of a Connection
+ *     header to keepalive
+ */
+int connection_option(char *value, int keepalive)
+{
+    char *tok, *save;
+
+    for (tok = strtok_r(value, ", \t\r\n", &save); tok;
+	 tok = strtok_r(NULL, ", \t\r\n", &save)) {
+	if (!strcasecmp(tok, "close"))
+	    return 0;
+	if (!strcasecmp(tok, "keep-alive"))
+	    keepalive = 1;
+    }
+    return keepalive;
+}
+
+/*
+ * conn_header - the end of a response's headers: a Connection header
+ *     where the client's default does not hold, then the blank line
+ */
+char *conn_header(int keepalive, char *version)
+{
+    if (!keepalive)
+	return "Connection: close\r\n\r\n";
+    if (strcmp(version, "HTTP/1.1"))
+	return "Connection: keep-alive\r\n\r\n";
+    return "\r\n";
+}
+
+/*
+ * parse_uri - map the URI of a parsed request line to a filename,
+ *             return 0 if dynamic content, 1 if static, -1 if the
+ *             filename does not fit in buf. The filename is built in
+ *             place in the request line unless it needs the default
+ *             page appended, then in buf, MAXLINE bytes.
  */
 /* $begin parse_uri */
-int parse_uri(char *uri, char *filename, char *cgiargs) 
-{
-    char *ptr;
-
-    if (!strstr(uri, "cgi-bin")) {  /* Static content */ //line:netp:parseuri:isstatic
-	strcpy(cgiargs, "");                             //line:netp:parseuri:clearcgi
-	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert1
-	strcat(filename, uri);                           //line:netp:parseuri:endconvert1
-	if (uri[strlen(uri)-1] == '/')                   //line:netp:parseuri:slashcheck
-	    strcat(filename, "home.html");               //line:netp:parseuri:appenddefault
-	return 1;
-    }
-    else {  /* Dynamic content */                        //line:netp:parseuri:isdynamic
-	ptr = index(uri, '?');                           //line:netp:parseuri:beginextract
-	if (ptr) {
-	    strcpy(cgiargs, ptr+1);
-	    *ptr = '\0';
-	}
-	else 
-	    strcpy(cgiargs, "");                         //line:netp:parseuri:endextract
-	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert2
-	strcat(filename, uri);                           //line:netp:parseuri:endconvert2
+int parse_uri(reqline_t *rl, char **filename, char *buf)
+{
+    /* The byte before the URI becomes the '.' that makes it relative */
+    *filename = rl->uri - 1;                             //line:netp:parseuri:beginconvert1
+    **filename = '.';                                    //line:netp:parseuri:endconvert1
+    if (!strncmp(rl->uri, "/cgi-bin/", 9))  /* Dynamic content */ //line:netp:parseuri:isdynamic
 	return 0;
+    if (rl->uri[rl->urilen - 1] == '/') {                //line:netp:parseuri:slashcheck
+	if (rl->urilen + 1 + sizeof("home.html") > MAXLINE)
+	    return -1;
+	memcpy(buf, *filename, rl->urilen + 1);
+	strcpy(buf + rl->urilen + 1, "home.html");       //line:netp:parseuri:appenddefault
+	*filename = buf;
     }
+    return 1;
 }
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - send a file back to the client: the headers kept with
+ *     it in the file cache, then its bytes straight from the page
+ *     cache. r holds on to fe until it is sent.
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize)
-{
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-    /* Send response headers to client */
-    get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));    //line:netp:servestatic:endserve
-
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); //line:netp:servestatic:mmap
-    Close(srcfd);                       //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
-    Munmap(srcp, filesize);             //line:netp:servestatic:munmap
-}
-
-/*
- * get_filetype - derive file type from file name
- */
-void get_filetype(char *filename, char *filetype) 
-{
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-	strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
+void serve_static(resp_t *r, fentry_t *fe, char *tail)
+{
+    /* Corked so that the headers go out in the same segment as the
+       start of the file */
+    set_cork(r->fd, 1);
+    r->corked = 1;
+    resp_add(r, fe->hdr, fe->hdrlen);
+    resp_add(r, tail, strlen(tail));
+    r->fe = fe;
+    r->srcfd = fe->fd;
+    r->offset = 0;
+    r->filesize = fe->st.st_size;
+}
+
+/*
+ * static_headers - write the response headers of a static file into
+ *     buf, all but the Connection header and the blank line, return
+ *     their length
+ */
+int static_headers(char *buf, size_t size, char *filename, off_t filesize)
+{
+    char *type, *encoding;
+    int n;
+
+    type = mime_type(filename, &encoding); //line:netp:servestatic:getfiletype
+    n = snprintf(buf, size, "HTTP/1.1 200 OK\r\n"
+		 "Server: Tiny Web Server\r\n"
+		 "Content-length: %lld\r\n"
+		 "Content-type: %s\r\n", (long long)filesize, type);
+    /* Caches must keep the gzip'ed and plain forms apart */
+    if (encoding)
+	n += snprintf(buf + n, size - n, "Content-Encoding: %s\r\n"
+		      "Vary: Accept-Encoding\r\n", encoding);
+    else if (mime_compressible(filename))
+	n += snprintf(buf + n, size - n, "Vary: Accept-Encoding\r\n");
+    return n;
+}
+
+/*
+ * preload_headers - the headers stored ahead of a preloaded body, ready
+ *     for the usual HTTP/1.1 client that keeps the connection
+ */
+int preload_headers(char *buf, size_t size, char *filename, off_t filesize)
+{
+    int n = static_headers(buf, size, filename, filesize);
+
+    return n + snprintf(buf + n, size - n, "\r\n");
+}
+
+/*
+ * fcache_headers - build the headers of a file once, when it enters
+ *     the file cache
+ */
+void fcache_headers(fentry_t *fe)
+{
+    fe->hdrlen = static_headers(fe->hdr, FC_HDRSIZE, fe->filename, fe->st.st_size);
+}
+
+/*
+ * serve_gzip - send the gzip'ed form of a file: a ".gz" sibling no
+ *     older than the file, else the file compressed once in gzcache,
+ *     else the file itself if compressing does not pay. r takes over
+ *     fe as in serve_static.
+ */
+void serve_gzip(resp_t *r, fentry_t *fe, char *tail)
+{
+    char gzname[MAXLINE];
+    fentry_t *sibling = NULL;
+    gzentry_t *ge;
+    time_t now = time(NULL), missing;
+
+    /* A missing sibling is remembered on fe and looked for again on the
+       cache's revalidation interval, not on every request */
+    missing = __atomic_load_n(&fe->gz_missing, __ATOMIC_RELAXED);
+    if ((!missing || now - missing >= fcache.interval) &&
+	(snprintf(gzname, MAXLINE, "%s.gz", fe->filename) >= MAXLINE ||
+	 (sibling = fcache_get(&fcache, gzname)) == NULL))
+	__atomic_store_n(&fe->gz_missing, now, __ATOMIC_RELAXED);
+    if (sibling != NULL) {
+	if (S_ISREG(sibling->st.st_mode) && sibling->fd >= 0 &&
+	    sibling->st.st_mtime >= fe->st.st_mtime) {
+	    fcache_put(&fcache, fe);
+	    serve_static(r, sibling, tail);
+	    return;
+	}
+	fcache_put(&fcache, sibling);
+    }
+
+    if ((ge = gzcache_get(&gzcache, fe)) == NULL || ge->data == NULL) {
+	if (ge)
+	    gzcache_put(&gzcache, ge);
+	serve_static(r, fe, tail);
+	return;
+    }
+    fcache_put(&fcache, fe);
+    r->ge = ge;
+    resp_add(r, ge->data, ge->hdrlen);
+    resp_add(r, tail, strlen(tail));
+    resp_add(r, ge->data + ge->hdrlen, ge->len - ge->hdrlen);
+}
+
+/*
+ * gen_init - fill the buffer synthetic bodies are cut from, with lines
+ *     of text so that they can be read when debugging
+ */
+void gen_init(void)
+{
+    static char line[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\n";
+
+    gen_buf = Malloc(GEN_BUFSIZE);
+    for (size_t i = 0; i < GEN_BUFSIZE; i++)
+	gen_buf[i] = line[i % (sizeof(line) - 1)];
+}
+
+/*
+ * serve_generated - answer /gen?size=N&delay_us=D&cacheable=1&chunked=1
+ *     with N bytes of gen_buf after D microseconds, cacheable for an
+ *     hour or not at all, and chunked if asked and the client is 1.1.
+ *     The body is not in r, gen_next puts it there a piece at a time.
+ */
+void serve_generated(resp_t *r, char *query, int chunked_ok, char *tail)
+{
+    long size = 0, delay = 0;
+    int cacheable = 0, chunked = 0, n;
+    char *arg, *save;
+
+    for (arg = strtok_r(query, "&", &save); arg; arg = strtok_r(NULL, "&", &save)) {
+	if (!strncmp(arg, "size=", 5))
+	    size = atol(arg + 5);
+	else if (!strncmp(arg, "delay_us=", 9))
+	    delay = atol(arg + 9);
+	else if (!strncmp(arg, "cacheable=", 10))
+	    cacheable = atoi(arg + 10);
+	else if (!strncmp(arg, "chunked=", 8))
+	    chunked = atoi(arg + 8) && chunked_ok;
+    }
+    if (size < 0 || size > GEN_MAXSIZE)
+	size = size < 0 ? 0 : GEN_MAXSIZE;
+
+    n = snprintf(r->hdr, MAXLINE, "HTTP/1.1 200 OK\r\n"
+		 "Server: Tiny Web Server\r\n"
+		 "Content-type: text/plain\r\n"
+		 "Cache-Control: %s\r\n",
+		 cacheable ? "public, max-age=3600" : "no-store");
+    if (chunked)
+	n += snprintf(r->hdr + n, MAXLINE - n, "Transfer-Encoding: chunked\r\n%s%s",
+		      tail, size == 0 ? "0\r\n\r\n" : "");
     else
-	strcpy(filetype, "text/plain");
-}  
+	n += snprintf(r->hdr + n, MAXLINE - n, "Content-length: %ld\r\n%s", size, tail);
+    resp_add(r, r->hdr, n);
+    r->gensize = size;
+    r->chunked = chunked;
+    r->delay = delay > 0 ? delay : 0;
+}
+
+/*
+ * gen_next - put the next piece of a synthetic body in r, as a chunk
+ *     of its own if it is chunked, with the last chunk after the last
+ *     piece
+ */
+void gen_next(resp_t *r)
+{
+    long n = r->gensize < GEN_BUFSIZE ? r->gensize : GEN_BUFSIZE;
+
+    r->gensize -= n;
+    if (r->chunked)
+	resp_add(r, r->chunk, sprintf(r->chunk, "%lx\r\n", n));
+    resp_add(r, gen_buf, n);
+    if (r->chunked && r->gensize > 0)
+	resp_add(r, "\r\n", 2);
+    else if (r->chunked)
+	resp_add(r, "\r\n0\r\n\r\n", 7);
+}
+
+/*
+ * serve_preloaded - send a file from the preloaded arena, with any
+ *     Connection header spliced in. With gzip only its ".gz" sibling
+ *     will do. Returns 1 if r is to send it, 0 if it is not there.
+ */
+int serve_preloaded(resp_t *r, char *filename, int gzip, char *tail)
+{
+    arena_t *ap;
+    asset_t *asset = NULL;
+    char gzname[MAXLINE];
+
+    if ((ap = arena_acquire()) == NULL)
+	return 0;
+    if (gzip) {
+	/* Without one, gzcache compresses the file */
+	snprintf(gzname, MAXLINE, "%s.gz", filename);
+	asset = arena_find(ap, gzname);
+    }
+    else
+	asset = arena_find(ap, filename);
+    if (asset == NULL) {
+	arena_release(ap);
+	return 0;
+    }
+    r->ap = ap;   /* requests in flight finish with the arena they began on */
+    if (!strcmp(tail, "\r\n"))
+	resp_add(r, asset->data, asset->len);
+    else {
+	/* Put tail in place of the blank line stored after the headers */
+	resp_add(r, asset->data, asset->hdrlen - 2);
+	resp_add(r, tail, strlen(tail));
+	resp_add(r, asset->data + asset->hdrlen, asset->len - asset->hdrlen);
+    }
+    return 1;
+}
+
+/*
+ * reload_thread - on SIGHUP, load the preload tree again and swap the
+ *     new arena in; requests in flight finish with the old one
+ */
+void *reload_thread(void *vargp)
+{
+    arena_t *ap;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+	if (sigwait(&reload_mask, &sig) != 0)
+	    continue;
+	if ((ap = arena_load(preload_dir, preload_headers)) == NULL) {
+	    fprintf(stderr, "Nothing to preload in %s, keeping the old files\n", preload_dir);
+	    continue;
+	}
+	arena_publish(ap);
+	printf("Preloaded %d files from %s\n", ap->n, preload_dir);
+    }
+}
+
+/*
+ * set_cork - hold back (on) or flush (off) partial TCP segments on fd;
+ *     a no-op on descriptors that are not TCP sockets
+ */
+void set_cork(int fd, int on)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/*
+ * resp_init - start the response to the request line in buf, with
+ *     nothing in it yet
+ */
+void resp_init(resp_t *r, int fd, char *buf)
+{
+    r->pending = 1;
+    r->fd = fd;
+    r->iovcnt = 0;
+    r->srcfd = -1;
+    r->map = NULL;
+    r->gensize = 0;
+    r->chunked = 0;
+    r->delay = 0;
+    r->corked = 0;
+    r->fe = NULL;
+    r->ge = NULL;
+    r->ap = NULL;
+    r->status = 200;
+    /* Parsing splits the line in place, the log wants it whole */
+    strncpy(r->request, buf, LOG_REQUEST - 1);
+    r->request[LOG_REQUEST - 1] = '\0';
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+}
+
+/*
+ * resp_add - append len bytes at base to what r sends from memory;
+ *     they must stay put until the response is done
+ */
+void resp_add(resp_t *r, void *base, size_t len)
+{
+    r->iov[r->iovcnt].iov_base = base;
+    r->iov[r->iovcnt].iov_len = len;
+    r->iovcnt++;
+}
+
+/*
+ * resp_trysend - write r out as far as rp's descriptor takes it: the
+ *     buffers in iov, then the rest of the file or of the synthetic
+ *     body, a piece at a time. Returns 0 once it is
+ *     all written, else -1 with errno set, EAGAIN where a nonblocking
+ *     descriptor is full and the caller is to try again once it has
+ *     room.
+ */
+int resp_trysend(rio_t *rp, resp_t *r)
+{
+    ssize_t n;
+
+    while (1) {
+	if (r->iovcnt > 0) {
+	    if (rio_trywritev(rp, r->iov, r->iovcnt) < 0)
+		return -1;
+	    r->iovcnt = 0;
+	}
+	if (r->gensize > 0) {
+	    gen_next(r);
+	    continue;
+	}
+	if (r->srcfd < 0 || r->offset == r->filesize)
+	    return 0;
+	if ((n = sendfile(rp->rio_fd, r->srcfd, &r->offset, r->filesize - r->offset)) > 0)
+	    continue;
+	if (n == 0) {
+	    /* The file shrank, the client would wait for the rest */
+	    errno = EIO;
+	    return -1;
+	}
+	if (errno == EINTR) /* Interrupted by sig handler return */
+	    continue;
+	if (errno != EINVAL && errno != ENOSYS)
+	    return -1;
+	/* The descriptor cannot take sendfile(), copy through a mapping instead */
+	r->map = Mmap(0, r->filesize, PROT_READ, MAP_PRIVATE, r->srcfd, 0); //line:netp:servestatic:mmap
+	resp_add(r, r->map + r->offset, r->filesize - r->offset);
+	r->srcfd = -1;
+    }
+}
+
+/*
+ * send_response - write r out in full on a blocking descriptor and
+ *     finish it, return -1 if the client is gone
+ */
+int send_response(rio_t *rp, resp_t *r)
+{
+    struct timespec ts;
+    int rc;
+
+    if (!r->pending)
+	return 0;
+    /* Stand in for a slow origin; this holds up the thread, as one would */
+    if (r->delay > 0) {
+	ts.tv_sec = r->delay / 1000000;
+	ts.tv_nsec = r->delay % 1000000 * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+	    ;
+    }
+    rc = resp_trysend(rp, r);
+    resp_done(r);
+    return rc;
+}
+
+/*
+ * resp_done - let go of what r sent from and log its request, whether
+ *     or not it all went out
+ */
+void resp_done(resp_t *r)
+{
+    struct timespec end;
+
+    if (r->corked)
+	set_cork(r->fd, 0);
+    if (r->map)
+	Munmap(r->map, r->filesize);  //line:netp:servestatic:munmap
+    if (r->fe)
+	fcache_put(&fcache, r->fe);
+    if (r->ge)
+	gzcache_put(&gzcache, r->ge);
+    if (r->ap)
+	arena_release(r->ap);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    accesslog(r->request, r->status, (end.tv_sec - r->start.tv_sec) * 1000000 +
+	      (end.tv_nsec - r->start.tv_nsec) / 1000);
+    r->pending = 0;
+}
+
 /* $end serve_static */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_dynamic - run a CGI program on behalf of the client, on one
+ *     of its persistent workers if it has them
  */
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char buf[MAXLINE], *emptylist[] = { NULL }, *out;
+    size_t len;
+    pid_t pid;
 
     /* Return first part of HTTP response */
     sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    sprintf(buf + strlen(buf), "Server: Tiny Web Server\r\n");
+
+    if ((out = cgipool_run(filename, cgiargs, &len)) != NULL) {
+	struct iovec iov[2] = {{buf, strlen(buf)}, {out, len}};
+
+	rio_writevn(fd, iov, 2);
+	free(out);
+	return;
+    }
+
+    /* No worker could take it, create a process for this request only */
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	return;
   
-    if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
+    if ((pid = Fork()) == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
+	/* The event loop's descriptors are nonblocking, CGI programs expect otherwise */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
+	close_from(STDERR_FILENO + 1);   /* nothing else of tiny's goes with it */
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    /* Parent waits for and reaps its own child, other threads may have CGI children too */
+    Waitpid(pid, NULL, 0); //line:netp:servedynamic:wait
 }
 /* $end serve_dynamic */
 
 /*
- * clienterror - returns an error message to the client
+ * detach_dynamic - run serve_dynamic on a thread of its own, for the
+ *     event loop: a CGI program may take its time, or wait for a busy
+ *     worker, and the response ends the connection anyway
+ */
+void detach_dynamic(int fd, char *filename, char *cgiargs)
+{
+    cgijob_t *job;
+    pthread_t tid;
+
+    job = Malloc(sizeof(cgijob_t));
+    job->filename = Malloc(strlen(filename) + 1);
+    strcpy(job->filename, filename);
+    job->cgiargs = Malloc(strlen(cgiargs) + 1);
+    strcpy(job->cgiargs, cgiargs);
+    if ((job->fd = dup(fd)) < 0 || pthread_create(&tid, NULL, dynamic_thread, job) != 0) {
+	if (job->fd >= 0)
+	    Close(job->fd);
+	serve_dynamic(fd, filename, cgiargs);
+	Free(job->filename);
+	Free(job->cgiargs);
+	Free(job);
+    }
+}
+
+void *dynamic_thread(void *vargp)
+{
+    cgijob_t *job = vargp;
+
+    Pthread_detach(pthread_self());
+    /* The loop is done with the connection, blocking writes are fine here */
+    fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) & ~O_NONBLOCK);
+    serve_dynamic(job->fd, job->filename, job->cgiargs);
+    Close(job->fd);
+    Free(job->filename);
+    Free(job->cgiargs);
+    Free(job);
+    return NULL;
+}
+
+/*
+ * clienterror - make r an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
+void clienterror(resp_t *r, char *cause, char *errnum,
+		 char *shortmsg, char *longmsg, char *tail)
 {
-    char buf[MAXLINE];
+    /* Build the HTTP response body, its length goes in the headers */
+    snprintf(r->body, MAXBUF, "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %.4096s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    sprintf(r->hdr, "HTTP/1.1 %s %s\r\n", errnum, shortmsg);
+    sprintf(r->hdr + strlen(r->hdr), "Content-type: text/html\r\n");
+    sprintf(r->hdr + strlen(r->hdr), "Content-length: %d\r\n%s", (int)strlen(r->body), tail);
+
+    /* The headers and body go out in one go */
+    resp_add(r, r->hdr, strlen(r->hdr));
+    resp_add(r, r->body, strlen(r->body));
 }
 /* $end clienterror */